@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // memfd_create
 #include <stdbool.h>
 #include <stdio.h>
 #include <arpa/inet.h>
@@ -11,15 +12,35 @@
 #include <signal.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include <semaphore.h>
+#include <pwd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // typedef enum MessageType { ... } message_type_t;
 typedef enum MessageType { 
 	LOGIN = 0,
 	LOGOUT = 1,
 	MESSAGE_SEND = 2,
+	KEEPALIVE = 3, // no-op that only resets the server's idle timeout, sent only if LOGIN_ACK listed "keepalive"
 	MESSAGE_RECV = 10,
 	DISCONNECT = 12,
-	SYSTEM = 13
+	SYSTEM = 13,
+	LOGIN_ACK = 14 // sent (fixed size) before history, lists the LOGIN capabilities the server accepted
 } message_type_t;
 
 // typedef struct __attribute__((packed)) Message { ... } message_t;
@@ -30,32 +51,436 @@ typedef struct __attribute__((packed)) Message {
 	char message[1024];
 } message_t;
 
+// the fixed fields at the start of every frame, sent on their own by the vectored write path
+typedef struct __attribute__((packed)) MessageHeader {
+	unsigned int message_type;
+	unsigned int timestamp;
+} message_header_t;
+
+// compact framing: this header is followed by the username and message bytes without padding or terminators
+// the high bit of the first byte is never set in a fixed size frame, so every frame says which format it uses
+#define COMPACT_FLAG 0x80
+#define CAPABILITY_COMPACT "compact" // LOGIN message field asking the server for compact framing
+#define CAPABILITY_KEEPALIVE "keepalive" // LOGIN message field asking whether the server understands KEEPALIVE
+
+typedef struct __attribute__((packed)) CompactHeader {
+	uint8_t message_type; // COMPACT_FLAG | type
+	uint8_t username_length; // at most 31
+	uint16_t message_length; // at most 1023, network byte order
+	uint32_t timestamp; // network byte order
+} compact_header_t;
+
+
+#define MENTION_MAX 512 // most mentions a 1024 byte message can hold ("@x" is two bytes)
+
+typedef struct MentionPattern {
+	char pattern[34]; // "@" followed by the username
+	size_t length; // length of the pattern including the "@"
+} mention_pattern_t;
+
+#define ADDRESS_MAX 8 // most resolved addresses of a domain that connects are attempted to
+#define HAPPY_EYEBALLS_DELAY_MS 250 // head start each connect attempt gets before the next address is tried as well
 
 typedef struct Settings {
-    struct sockaddr_in server;
+    struct sockaddr_in server; // port and first address
+    struct in_addr addresses[ADDRESS_MAX]; // every address --domain resolved to in resolver order, or just the --ip one
+    size_t address_count; // filled in from server after the arguments are parsed unless --domain did it
+    double connect_timeout; // seconds a connect may take before the client gives up
+    bool reconnect; // keep the sessions alive across disconnects, implies the event loop
+    unsigned int keepalive_interval; // seconds of silence before a session sends KEEPALIVE, 0 for none, implies the event loop
+    bool io_uring; // the event loop receives and sends through one io_uring instead of read/write per socket
+    unsigned int refresh_ms; // output is written at most once per this many ms with floods skipped, 0 writes every batch right away
     bool quiet;
-    int socket_fd;
-    bool running;
-    char username[32];
+    atomic_bool running; // shared between the signal handler, the receive thread and main
+    bool event_loop; // single threaded epoll mode instead of the receive thread
+    size_t session_count; // number of sessions to log in, more than one implies the event loop
+    bool bench; // send timed messages from every session and report latency instead of chatting
+    double bench_rate; // bench messages per second per session, kept under the server's limit of 5
+    double bench_duration; // seconds to send bench messages for
+    bool compact; // ask the server for compact framing at LOGIN
+    bool batch; // read stdin in blocks and send paced, coalesced frames
+    double send_rate; // MESSAGE_SEND frames per second every session may send, lowered by a rate limit DISCONNECT
+    unsigned int send_burst; // MESSAGE_SEND frames a session may send at once
+    bool stats; // print I/O and render counters on exit and on SIGUSR1
+    unsigned int stats_interval; // seconds between machine readable stats lines, 0 for none
+    const char* cache_path; // --cache file that MESSAGE_RECV frames are appended to, NULL for none
+    const char* replay_path; // --replay capture fed through the receive and render pipeline instead of a server, NULL for none
+    size_t scrollback; // cached messages printed before connecting
+    bool since_set; // --since was passed: print the cached messages from since on and exit
+    time_t since;
+    char username[32]; // from --username, otherwise looked up from the effective user id
 } settings_t;
 
+#define RECEIVE_BUFFER_SIZE 65536 // most bytes read from the socket with a single read
+
+typedef struct ReceiveBuffer {
+	char data[RECEIVE_BUFFER_SIZE]; // raw bytes from the server, frames are parsed in place
+	size_t start; // offset of the first byte that hasn't been parsed yet
+	size_t end; // offset one past the last byte read from the socket
+	message_t decoded; // compact frames are expanded here since their layout differs from message_t
+} receive_buffer_t;
+
+#define FRAME_QUEUE_CAPACITY 1024 // frames the receive thread can get ahead of the render thread (power of two)
+#define FRAME_READ_BATCH 32 // pool slots the receive thread reads into with a single readv
+#define FRAME_POOL_SLOTS (FRAME_QUEUE_CAPACITY + FRAME_READ_BATCH + 2) // queued, being read, the partial one and the one rendering
+#define FRAME_POOL_NONE UINT32_MAX
+
+typedef struct FramePool {
+	// fixed pool of frame slots shared by the receive and render threads: a frame is read (or decoded) into a slot
+	// once and every later stage works on the slot, so the threaded pipeline neither allocates nor copies frames
+	message_t slots[FRAME_POOL_SLOTS]; // frames in host byte order once complete
+	atomic_uint refs[FRAME_POOL_SLOTS]; // stages still using the slot, it goes back to the free list at 0
+	uint32_t next[FRAME_POOL_SLOTS]; // free list links
+	_Alignas(64) _Atomic uint64_t free_head; // lock free (Treiber) stack of free slots, tag << 32 | index so a reused head fails the CAS
+} frame_pool_t;
+
+typedef struct FrameReader {
+	// threaded mode with fixed size framing: the socket is read with readv straight into pool slots
+	uint32_t partial; // slot holding the start of a frame the last read stopped in, FRAME_POOL_NONE if none
+	size_t filled; // bytes of the partial slot already read
+} frame_reader_t;
+
+typedef struct FrameQueue {
+	// bounded lock free single producer (receive thread) single consumer (render thread) ring of frame pool slots
+	uint32_t slots[FRAME_QUEUE_CAPACITY]; // indexes into the frame pool, each holding a reference
+	_Alignas(64) atomic_size_t head; // next slot to render, only advanced by the render thread
+	_Alignas(64) atomic_size_t tail; // next slot to fill, only advanced by the receive thread
+	sem_t ready; // posted once per pushed frame (and on close) so the render thread can sleep while empty
+	atomic_bool closed; // the receive thread is done, nothing more will be pushed
+	atomic_bool consumer_done; // the render thread exited, pushes can never succeed again
+	atomic_size_t dropped; // chat frames dropped because the render thread fell a whole queue behind
+} frame_queue_t;
+
+typedef struct Stats {
+	// counters are only written by the thread that owns the stage, dumps from other threads are approximate
+	uint64_t read_calls; // read() syscalls on the socket
+	uint64_t bytes_read; // bytes read from the socket
+	uint64_t frames_read; // complete frames parsed
+	uint64_t short_reads; // reads that ended in the middle of a frame
+	uint64_t read_retries; // reads retried after EINTR
+	uint64_t write_calls; // write()/writev() syscalls on the socket
+	uint64_t bytes_written; // bytes written to the socket
+	uint64_t frames_written; // frames sent
+	uint64_t keepalives; // KEEPALIVE frames sent
+	uint64_t short_writes; // writes that stopped before everything was written
+	uint64_t write_retries; // writes retried after EINTR
+	uint64_t frames_dropped; // frames dropped because the render thread fell behind
+	uint64_t render_skipped; // chat messages not printed because --refresh-ms was too far behind
+	uint64_t pool_waits; // times the receive thread waited for a free frame pool slot
+	uint64_t send_queued; // lines waiting in the send queue right now
+	uint64_t send_queue_max; // most lines that waited in the send queue at once
+	uint64_t sends_paced; // lines that had to wait for the rate limit
+	uint64_t rendered; // messages formatted for stdout
+	uint64_t render_ns; // time spent formatting messages
+	uint64_t receive_ns; // time the receive thread spent reading, parsing and queueing frames
+	uint64_t queue_wait_ns; // part of receive_ns spent waiting for room in the frame queue
+	uint64_t queue_waits; // times the receive thread waited for room in the frame queue
+	uint64_t store_ns; // time spent appending to the cache and the search index
+	uint64_t flush_ns; // time the render thread spent writing caught up batches to stdout
+	uint64_t mentions; // mentions highlighted
+} stats_t;
+
+#define RECONNECT_INITIAL_MS 500 // backoff before the first reconnect attempt, doubled after every failure
+#define RECONNECT_MAX_MS 30000 // upper bound on the backoff
+#define KEEPALIVE_MAX 840 // longest --keepalive interval, a minute under the server's 15 minute idle timeout
+#define SEEN_MAX 64 // hashes of the frames rendered in the newest second that are remembered for deduplication
+
+// the server disconnects a session that sends a 6th message within a second, so sends are paced by a token bucket:
+// a burst of B messages and R per second from then on stay at 5 within any second as long as B + R <= 5
+#define SEND_RATE_DEFAULT 3.0
+#define SEND_BURST_DEFAULT 2
+#define SEND_QUEUE_CAPACITY 64 // validated lines a session holds back for the rate limit before stdin is left unread
+#define RATE_LIMIT_REASON "Too many messages (rate " // the server's DISCONNECT reason, followed by "R/s, burst B)"
+
+typedef struct SendQueue {
+	// ring of validated lines waiting for a token, framed only when they go out so they pick up compact framing
+	char texts[SEND_QUEUE_CAPACITY][1024];
+	size_t lengths[SEND_QUEUE_CAPACITY];
+	size_t head; // oldest line
+	size_t count; // number of lines waiting
+	double tokens; // messages that may go out right now, refilled at settings.send_rate up to settings.send_burst
+	uint64_t refilled_ns; // monotonic time tokens was last brought up to date
+} send_queue_t;
+
+typedef struct Session {
+	int socket_fd; // connection to the server, -1 once closed
+	char username[32]; // username this session logs in with
+	mention_pattern_t mention; // built once from the username
+	bool quiet; // do not highlight mentions
+	bool render; // only one session prints chat messages, the others just drain their socket
+	atomic_bool logged_out; // LOGOUT was sent or DISCONNECT received, nothing more may be sent
+	bool compact_requested; // LOGIN asked for compact framing
+	atomic_bool compact; // the server acknowledged compact framing, outbound frames use it too
+	bool keepalive; // the server acknowledged KEEPALIVE
+	uint64_t keepalive_ns; // monotonic time the next KEEPALIVE is due unless something else is sent first
+	uint64_t connect_started_ns; // monotonic time the connection was started
+	uint64_t connected_ns; // monotonic time the connection was established
+	uint64_t login_sent_ns; // monotonic time the LOGIN went out
+	uint64_t first_frame_ns; // monotonic time the first frame arrived after LOGIN, 0 until then
+	uint64_t history_done_ns; // monotonic time the first SYSTEM frame (the welcome after the history) arrived, 0 until then
+	uint64_t reconnect_ns; // monotonic time of the next reconnect attempt, 0 unless the connection was lost
+	unsigned int reconnect_attempts; // failed attempts since the last successful login, drives the backoff
+	bool resuming; // reconnected and still receiving the history, frames rendered before are dropped
+	uint32_t last_timestamp; // newest MESSAGE_RECV timestamp rendered
+	uint64_t seen[SEEN_MAX]; // hashes of the frames rendered with last_timestamp (timestamps only have second precision)
+	size_t seen_count;
+	uint64_t next_send_ns; // monotonic time of the next bench message
+	unsigned int sequence; // sequence number of the next bench message
+	frame_queue_t* queue; // threaded mode: frames are handed to the render thread instead of handled inline
+	send_queue_t send_queue; // stdin lines waiting for the rate limit
+	stats_t stats; // hot path counters for --stats
+	frame_reader_t reader; // threaded mode: partial frame of the last readv into pool slots
+	uint32_t uring_index; // --io-uring: the session's engine index, carried in the user_data of its receives
+	uint16_t uring_generation; // --io-uring: bumped whenever the socket goes away so late completions for it are ignored
+	uint32_t send_head; // --io-uring: oldest frame waiting for the next submission, URING_NONE if none
+	uint32_t send_tail; // --io-uring: newest frame waiting
+	unsigned int sends_in_flight; // --io-uring: linked sends submitted but not completed yet
+	bool send_dirty; // --io-uring: listed for the next submission
+	receive_buffer_t receive; // frames read from this session's socket
+} session_t;
+
+typedef struct Engine {
+	session_t** sessions; // every session driven by this process
+	size_t session_count; // number of sessions
+	size_t open_count; // sessions whose socket is still open
+	size_t next_sender; // round robin cursor used to pick the session that sends the next stdin line
+} engine_t;
+
+#define URING_ENTRIES 512 // submission queue entries of the process wide io_uring
+#define URING_BUFFERS 256 // receive buffers every session's multishot recv picks from (power of two)
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_GROUP 0
+#define URING_NONE UINT32_MAX
+#define URING_RECV 1ULL // completion kinds, kept in the top byte of user_data
+#define URING_SEND 2ULL
+#define URING_STDIN 3ULL
+
+typedef struct UringSend {
+	// an outbound frame copied out of the caller's buffers, it has to stay put until the kernel sent it
+	char data[sizeof(message_t)];
+	size_t length;
+	session_t* session;
+	uint16_t generation; // session->uring_generation when it was queued
+	uint32_t next; // next frame of the session's pending list, or the next free slot
+} uring_send_t;
+
+typedef struct Uring {
+	// one io_uring per process for --io-uring: a multishot recv per socket into provided buffers and linked sends,
+	// so every socket of the event loop is served by one io_uring_enter per iteration instead of a read or write each
+	int fd; // -1 unless --io-uring set it up
+	void* sq_ring; // mapped submission ring, the completion ring shares the mapping (IORING_FEAT_SINGLE_MMAP)
+	size_t ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	_Atomic unsigned* sq_head; // advanced by the kernel
+	_Atomic unsigned* sq_tail;
+	unsigned* sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail; // sqes filled, published to the kernel by uring_enter
+	unsigned sq_submitted; // tail as of the last uring_enter
+	_Atomic unsigned* cq_head;
+	_Atomic unsigned* cq_tail; // advanced by the kernel
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+	struct io_uring_buf_ring* buffers; // provided buffer ring registered as URING_BUFFER_GROUP
+	char* buffer_data; // URING_BUFFERS buffers of URING_BUFFER_SIZE bytes
+	uint16_t buffer_tail;
+	uring_send_t* sends; // frames waiting for or being sent
+	uint32_t send_count;
+	uint32_t send_free; // free list of sends
+	session_t** dirty; // sessions with frames waiting for the next submission
+	size_t dirty_count;
+	bool stdin_reading; // a read of stdin is in flight
+	bool stdin_done; // it completed with stdin_result (bytes read or -errno), the event loop hasn't taken it yet
+	int32_t stdin_result;
+	uint64_t enters; // io_uring_enter calls
+	uint64_t completions; // completions reaped
+} uring_t;
+
+#define INPUT_BUFFER_SIZE 65536 // most bytes read from stdin with a single read in the event loop and in batch mode
+
+typedef struct InputBuffer {
+	char data[INPUT_BUFFER_SIZE]; // raw stdin bytes, complete lines are sent from here in place
+	size_t length; // number of bytes currently buffered
+	bool discarding; // skipping the rest of a line that was too long
+} input_buffer_t;
+
+#define RATE_LIMIT_MESSAGES 4 // most frames batch mode coalesces into one writev
+
+typedef struct Batch {
+	// batch mode sends straight from the input buffer, paced by the first session's token bucket
+	const char* lines[RATE_LIMIT_MESSAGES]; // validated lines waiting to be sent, pointing into the input buffer
+	size_t lengths[RATE_LIMIT_MESSAGES];
+	size_t count; // number of lines waiting
+} batch_t;
+
+typedef struct OutboundFrame {
+	message_header_t header; // storage for the headers the iovecs point at
+	compact_header_t compact_header;
+	struct iovec iov[5]; // header, username, padding, text, padding (compact frames use the first three kinds only)
+	int iovcnt;
+	size_t length; // bytes the frame takes on the wire
+} outbound_frame_t;
+
+#define RENDER_BUFFER_SIZE 65536 // size of the preallocated output buffer
+#define RENDER_LINE_MAX 8192 // upper bound on a single rendered line (every mention adds color codes)
+
+typedef struct TimestampCache {
+	bool valid; // false until the first timestamp was formatted
+	time_t minute_start; // first second of the cached minute
+	char text[32]; // "%Y-%m-%d %H:%M:%S" of the last timestamp, only the seconds change within the minute
+	size_t length; // length of text
+} timestamp_cache_t;
+
+#define RENDER_BACKLOG_MAX 256 // with --refresh-ms, chat messages this far behind the newest received one are skipped
+#define REFRESH_MS_MAX 1000
+
+typedef struct Renderer {
+	char buffer[RENDER_BUFFER_SIZE]; // formatted output waiting to be written to stdout
+	size_t length; // number of bytes currently stored in the buffer
+	bool rang; // a bell is in the buffer already, the rest of the batch stays silent
+	uint64_t flushed_ns; // monotonic time of the last write, --refresh-ms holds output back until an interval after it
+	size_t backlog; // --refresh-ms: frames already received behind the one being rendered
+	size_t skipped; // chat messages skipped since the last "messages skipped" notice
+	timestamp_cache_t clock; // most messages in a burst or history replay share the same minute
+} renderer_t;
+
+#define BENCH_PREFIX "bench " // start of every bench payload: "bench <sequence> <send time in ns>"
+#define BENCH_GRACE_NS 2000000000ULL // how long to wait for outstanding echoes after the last send
+
+typedef struct Bench {
+	uint64_t start_ns; // monotonic time sending started
+	uint64_t stop_ns; // monotonic time sending stops
+	uint64_t interval_ns; // time between two messages of the same session
+	uint64_t sent; // bench messages sent by all sessions
+	uint64_t frames_received; // frames of any kind received by all sessions
+	uint64_t* latencies; // send to broadcast receive round trip of every echoed message
+	size_t latency_count; // number of latencies recorded
+	size_t latency_capacity; // allocated length of latencies
+} bench_t;
+
+// --cache file: a 64 byte header followed by message_t frames in host byte order with nondecreasing timestamps
+// the frames are the timestamp index, a binary search finds where any second starts
+#define CACHE_MAGIC "MYCORDC1"
+#define CACHE_VERSION 1
+#define CACHE_GROW_FRAMES 4096 // frames the file grows by, so appends don't remap every time
+
+typedef struct CacheHeader {
+	char magic[8]; // CACHE_MAGIC
+	uint32_t version; // CACHE_VERSION
+	uint32_t frame_size; // sizeof(message_t), files from a build with another layout are refused
+	uint64_t frame_count; // frames written, anything past them is preallocated space
+	char reserved[40];
+} cache_header_t;
+
+typedef struct Cache {
+	int fd; // -1 when no cache is open
+	char* map; // the whole file mapped shared, the header first
+	size_t capacity; // frames that fit in the mapping
+} cache_t;
+
+// FILE.idx next to a --cache FILE: an inverted index from username and token keys to cache frame numbers
+// the file is a header followed by postings in frame order, it is loaded into a hash table of posting lists at startup
+#define INDEX_MAGIC "MYCORDI1"
+#define INDEX_VERSION 1
+#define INDEX_TOKENS_MAX 512 // most keys a single frame can add (a 1023 byte message has at most 512 tokens)
+#define SEARCH_RESULTS_MAX 20 // newest matches printed by /search and /from
+
+typedef struct IndexHeader {
+	char magic[8]; // INDEX_MAGIC
+	uint32_t version; // INDEX_VERSION
+	uint32_t posting_size; // sizeof(posting_t)
+	uint64_t frame_count; // cache frames whose postings are all in the file
+} index_header_t;
+
+typedef struct __attribute__((packed)) Posting {
+	uint64_t key; // index_key of a lowercased token or username
+	uint32_t frame; // cache frame that contains it
+} posting_t;
+
+typedef struct PostingList {
+	uint64_t key; // 0 marks an empty slot
+	uint32_t* frames; // ascending cache frame numbers
+	uint32_t count;
+	uint32_t capacity;
+} posting_list_t;
+
+typedef struct SearchIndex {
+	int fd; // -1 when no index is open
+	posting_list_t* slots; // open addressing hash table keyed by posting key
+	size_t slot_count; // power of two
+	size_t used; // slots with a key
+	uint64_t frame_count; // cache frames indexed
+} search_index_t;
+
 static char* COLOR_RED = "\033[31m";
 static char* COLOR_GRAY = "\033[90m";
 static char* COLOR_RESET = "\033[0m";
+static const char ZERO_PADDING[1024] = {0}; // shared padding for the unused bytes of outbound frames
 static settings_t settings = {0}; 
+static bench_t bench = {0};
+static atomic_bool stats_requested = false; // SIGUSR1 arrived, a summary should be printed
+static atomic_bool stats_line_due = false; // the --stats-interval timer fired
+static uint64_t start_ns = 0; // monotonic time the client started
+static renderer_t renderer = {0};
+static frame_queue_t frame_queue; // only used by the threaded mode
+static frame_pool_t frame_pool; // slots for the frames the threaded mode has in flight
+static cache_t cache = { .fd = -1 }; // appended to by whoever renders (the render thread or the event loop)
+static search_index_t search_index = { .fd = -1 }; // updated along with the cache
+static uring_t uring = { .fd = -1 }; // only set up by the event loop with --io-uring
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER; // the render thread appends while the main thread searches
 
 
 void print_help() { 
 	// this function prints the help function out to stdout when called by the main function
-	fprintf(stdout, "usage: ./client [-h] [--port PORT] [--ip IP] [--domain DOMAIN] [--quiet]\n\n"
+	fprintf(stdout, "usage: ./client [-h] [--port PORT] [--ip IP] [--domain DOMAIN] [--quiet] [--event-loop] [--sessions N]\n"
+		"              [--bench] [--rate R] [--duration SECONDS] [--stats] [--stats-interval N]\n"
+		"              [--compact] [--batch] [--username NAME] [--connect-timeout S]\n"
+		"              [--reconnect] [--keepalive SECONDS] [--cache FILE] [--scrollback N] [--since TIME]\n"
+		"              [--send-rate R] [--send-burst B] [--refresh-ms MS] [--replay FILE] [--io-uring]\n\n"
 
 		"mycord client\n\n"
 		"options:\n"
 		"  --help                show this help message and exit\n"
 		"  --port PORT           port to connect to (default: 8080)\n"
 		"  --ip IP               IP to connect to (default: \"127.0.0.1\")\n"
-		"  --domain DOMAIN       Domain name to connect to (if domain is specified, IP must not be)\n"
-		"  --quiet               do not perform alerts or mention highlighting\n\n"
+		"  --domain DOMAIN       Domain name to connect to (if domain is specified, IP must not be),\n"
+		"                        every address it resolves to is tried, a new one every 250ms until one connects\n"
+		"  --connect-timeout S   give up if connecting takes longer than S seconds (default: 10)\n"
+		"  --reconnect           reconnect with jittered exponential backoff when the server disconnects,\n"
+		"                        skipping the history that was already shown (uses the event loop)\n"
+		"  --keepalive SECONDS   send a no-op after SECONDS (at most 840) without traffic so idle sessions\n"
+		"                        aren't timed out, if the server supports it (uses the event loop)\n"
+		"  --cache FILE          append every received chat message to FILE (created if missing)\n"
+		"  --scrollback N        print the last N cached messages before connecting (needs --cache)\n"
+		"  --since TIME          print the cached messages from TIME on and exit without connecting (needs --cache),\n"
+		"                        TIME is unix seconds or local \"YYYY-MM-DD[ HH:MM[:SS]]\"\n"
+		"  --username NAME       log in as NAME (alphanumeric, under 32 characters) instead of the current user\n"
+		"  --quiet               do not perform alerts or mention highlighting\n"
+		"  --refresh-ms MS       write output to the terminal at most every MS ms (e.g. 16) and skip chat\n"
+		"                        messages more than 256 behind the newest during floods\n"
+		"  --event-loop          handle stdin and the server on one thread with epoll\n"
+		"  --io-uring            serve every socket of the event loop through one io_uring (multishot receives,\n"
+		"                        linked sends) instead of a read or write each, falls back to epoll if unavailable\n"
+		"  --sessions N          log in N sessions named USERNAME1..USERNAMEN on one event loop,\n"
+		"                        only the first one prints messages and stdin lines are sent round robin\n"
+		"  --bench               send numbered messages from every session and report latency, throughput\n"
+		"                        and connect/login time instead of chatting\n"
+		"  --rate R              bench messages per second per session (default: 2, must be under 5)\n"
+		"  --duration SECONDS    how long the bench sends for (default: 10)\n"
+		"  --send-rate R         messages per second a session sends once its burst is used up (default: 3),\n"
+		"                        lowered when the server disconnects for sending too fast\n"
+		"  --send-burst B        messages a session may send at once (default: 2), lines typed faster wait in a queue\n"
+		"  --batch               read piped stdin in large blocks and send up to 4 messages per write,\n"
+		"                        paced like every other send\n"
+		"  --compact             ask the server for compact length prefixed frames (falls back to\n"
+		"                        fixed size frames if the server doesn't acknowledge it)\n"
+		"  --stats               print I/O and render counters on exit and on SIGUSR1 (to stderr)\n"
+		"  --stats-interval N    also print a machine readable stats line every N seconds\n"
+		"  --replay FILE         feed a capture of raw frames, a --cache file or a server messages.log through\n"
+		"                        the receive and render pipeline as fast as possible and report throughput\n"
+		"                        and per stage timing instead of connecting (implies --stats)\n\n"
 		"examples:\n"
 		"  ./client --help (prints the above message)\n"
 		"  ./client --port 1738 (connects to a mycord server at 127.0.0.1:1738)\n"
@@ -68,6 +493,29 @@ void print_error(const char* error_message) {
 	fprintf(stderr, "Error: %s\n", error_message);
 }
 
+int parse_time(const char* text, time_t* result) {
+	// parses unix seconds or a local "YYYY-MM-DD[ HH:MM[:SS]]"
+	// returns 0 on success and -1 on failure
+	char* end;
+	long long seconds = strtoll(text, &end, 10);
+	if (*end == '\0' && end != text) {
+		*result = (time_t)seconds;
+		return 0;
+	}
+	struct tm local = {0};
+	int consumed = 0;
+	int fields = sscanf(text, "%d-%d-%d%n %d:%d%n:%d%n", &local.tm_year, &local.tm_mon, &local.tm_mday, &consumed,
+		&local.tm_hour, &local.tm_min, &consumed, &local.tm_sec, &consumed);
+	if (fields < 3 || fields == 4 || text[consumed] != '\0') {
+		return -1;
+	}
+	local.tm_year -= 1900;
+	local.tm_mon -= 1;
+	local.tm_isdst = -1; // lets mktime work out daylight saving time
+	*result = mktime(&local);
+	return *result == (time_t)-1 ? -1 : 0;
+}
+
 int process_args(int argc, char *argv[], settings_t* settings) {
 	// parses the CLI arguments provided
 	// returns 0 on success and -1 on failure
@@ -118,16 +566,205 @@ int process_args(int argc, char *argv[], settings_t* settings) {
 				print_error("Missing argument after --domain"); 
 				return -1; 
 			}
-			struct hostent* host_info = gethostbyname(argv[i]); // gets the ip address and host info from a domain
-			if (host_info == NULL) { 
-				print_error("Could not resolve domain"); 
+			// gets every IPv4 address of the domain, the server only listens on IPv4
+			struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+			struct addrinfo* results;
+			int error = getaddrinfo(argv[i], NULL, &hints, &results);
+			if (error != 0) {
+				print_error(error == EAI_SYSTEM ? strerror(errno) : gai_strerror(error));
+				print_error("Could not resolve domain");
+				return -1;
+			}
+			settings->address_count = 0;
+			for (struct addrinfo* result = results; result != NULL && settings->address_count < ADDRESS_MAX; result = result->ai_next) {
+				struct in_addr address = ((struct sockaddr_in*)result->ai_addr)->sin_addr;
+				bool duplicate = false;
+				for (size_t j = 0; j < settings->address_count; j++) {
+					duplicate = duplicate || settings->addresses[j].s_addr == address.s_addr;
+				}
+				if (!duplicate) {
+					settings->addresses[settings->address_count++] = address;
+				}
+			}
+			freeaddrinfo(results);
+			settings->server.sin_addr = settings->addresses[0];
+		} else if (strcmp(arg, "--cache") == 0) { // checks if the cache flag was passed
+			i++; // moves to the next argument which should have the path
+			if (i == argc) {
+				print_error("Missing argument after --cache");
+				return -1;
+			}
+			settings->cache_path = argv[i];
+		} else if (strcmp(arg, "--replay") == 0) { // checks if the replay flag was passed
+			i++; // moves to the next argument which should have the path
+			if (i == argc) {
+				print_error("Missing argument after --replay");
+				return -1;
+			}
+			settings->replay_path = argv[i];
+		} else if (strcmp(arg, "--scrollback") == 0) { // checks if the scrollback flag was passed
+			i++; // moves to the next argument which should have the count
+			if (i == argc) {
+				print_error("Missing argument after --scrollback");
+				return -1;
+			}
+			int count = atoi(argv[i]);
+			if (count < 1) {
+				print_error("Invalid scrollback");
+				return -1;
+			}
+			settings->scrollback = (size_t)count;
+		} else if (strcmp(arg, "--since") == 0) { // checks if the since flag was passed
+			i++; // moves to the next argument which should have the time
+			if (i == argc) {
+				print_error("Missing argument after --since");
+				return -1;
+			}
+			if (parse_time(argv[i], &settings->since) == -1) {
+				print_error("Invalid time, expected unix seconds or \"YYYY-MM-DD[ HH:MM[:SS]]\"");
+				return -1;
+			}
+			settings->since_set = true;
+		} else if (strcmp(arg, "--keepalive") == 0) { // checks if the keepalive flag was passed
+			i++; // moves to the next argument which should have the interval
+			if (i == argc) {
+				print_error("Missing argument after --keepalive");
+				return -1;
+			}
+			int interval = atoi(argv[i]);
+			if (interval < 1 || interval > KEEPALIVE_MAX) { // the server disconnects after 15 idle minutes
+				print_error("Keepalive interval must be between 1 and 840 seconds");
+				return -1;
+			}
+			settings->keepalive_interval = (unsigned int)interval;
+		} else if (strcmp(arg, "--refresh-ms") == 0) { // checks if the refresh flag was passed
+			i++; // moves to the next argument which should have the interval
+			if (i == argc) {
+				print_error("Missing argument after --refresh-ms");
+				return -1;
+			}
+			int interval = atoi(argv[i]);
+			if (interval < 1 || interval > REFRESH_MS_MAX) {
+				print_error("Refresh interval must be between 1 and 1000 ms");
+				return -1;
+			}
+			settings->refresh_ms = (unsigned int)interval;
+		} else if (strcmp(arg, "--io-uring") == 0) { // checks if the io_uring flag was passed
+			settings->io_uring = true;
+		} else if (strcmp(arg, "--reconnect") == 0) { // checks if the reconnect flag was passed
+			settings->reconnect = true;
+		} else if (strcmp(arg, "--connect-timeout") == 0) { // checks if the connect timeout flag was passed
+			i++; // moves to the next argument which should have the timeout
+			if (i == argc) {
+				print_error("Missing argument after --connect-timeout");
+				return -1;
+			}
+			char* end;
+			double timeout = strtod(argv[i], &end);
+			if (*end != '\0' || !(timeout > 0)) {
+				print_error("Invalid connect timeout");
+				return -1;
+			}
+			settings->connect_timeout = timeout;
+		} else if (strcmp(arg, "--username") == 0) { // checks if the username flag was passed
+			i++; // moves to the next argument which should have the username
+			if (i == argc) {
+				print_error("Missing argument after --username");
 				return -1;
 			}
-			if (host_info->h_addrtype == AF_INET) { // checks for IPv4 address
-				memcpy(&settings->server.sin_addr, host_info->h_addr_list[0], host_info->h_length);
+			size_t length = strlen(argv[i]);
+			bool valid = length > 0 && length < sizeof(settings->username);
+			for (size_t j = 0; valid && j < length; j++) {
+				valid = isalnum((unsigned char)argv[i][j]);
+			}
+			if (!valid) { // the server disconnects anything else at LOGIN
+				print_error("Username must be alphanumeric and under 32 characters");
+				return -1;
 			}
+			memcpy(settings->username, argv[i], length + 1);
 		} else if (strncmp(arg, "--quiet", 7) == 0) { // checks if the quiet flag was passed
 			settings->quiet = true; // sets the quiet setting to true
+		} else if (strncmp(arg, "--event-loop", 12) == 0) { // checks if the event loop flag was passed
+			settings->event_loop = true;
+		} else if (strcmp(arg, "--sessions") == 0) { // checks if the sessions flag was passed
+			i++; // moves to the next argument which should have the session count
+			if (i == argc) {
+				print_error("Missing argument after --sessions");
+				return -1;
+			}
+			int count = atoi(argv[i]);
+			if (count < 1 || count > 100000) {
+				print_error("Invalid session count");
+				return -1;
+			}
+			settings->session_count = (size_t)count;
+		} else if (strcmp(arg, "--batch") == 0) { // checks if the batch flag was passed
+			settings->batch = true;
+		} else if (strcmp(arg, "--send-rate") == 0) { // checks if the send rate flag was passed
+			i++; // moves to the next argument which should have the rate
+			if (i == argc) {
+				print_error("Missing argument after --send-rate");
+				return -1;
+			}
+			char* end;
+			double rate = strtod(argv[i], &end);
+			if (*end != '\0' || !(rate > 0)) {
+				print_error("Invalid send rate");
+				return -1;
+			}
+			settings->send_rate = rate;
+		} else if (strcmp(arg, "--send-burst") == 0) { // checks if the send burst flag was passed
+			i++; // moves to the next argument which should have the burst
+			if (i == argc) {
+				print_error("Missing argument after --send-burst");
+				return -1;
+			}
+			int burst = atoi(argv[i]);
+			if (burst < 1 || burst > SEND_QUEUE_CAPACITY) {
+				print_error("Send burst must be between 1 and 64 messages");
+				return -1;
+			}
+			settings->send_burst = (unsigned int)burst;
+		} else if (strcmp(arg, "--compact") == 0) { // checks if the compact flag was passed
+			settings->compact = true;
+		} else if (strcmp(arg, "--stats") == 0) { // checks if the stats flag was passed
+			settings->stats = true;
+		} else if (strcmp(arg, "--stats-interval") == 0) { // checks if the stats interval flag was passed
+			i++; // moves to the next argument which should have the interval
+			if (i == argc) {
+				print_error("Missing argument after --stats-interval");
+				return -1;
+			}
+			int interval = atoi(argv[i]);
+			if (interval < 1) {
+				print_error("Invalid stats interval");
+				return -1;
+			}
+			settings->stats = true;
+			settings->stats_interval = (unsigned int)interval;
+		} else if (strcmp(arg, "--bench") == 0) { // checks if the bench flag was passed
+			settings->bench = true;
+		} else if (strcmp(arg, "--rate") == 0 || strcmp(arg, "--duration") == 0) { // bench parameters
+			i++; // moves to the next argument which should have the value
+			if (i == argc) {
+				print_error(strcmp(arg, "--rate") == 0 ? "Missing argument after --rate" : "Missing argument after --duration");
+				return -1;
+			}
+			char* end;
+			double value = strtod(argv[i], &end);
+			if (*end != '\0' || !(value > 0)) { // checks if the conversion failed
+				print_error(strcmp(arg, "--rate") == 0 ? "Invalid rate" : "Invalid duration");
+				return -1;
+			}
+			if (strcmp(arg, "--rate") == 0) {
+				if (value >= 5) { // the server disconnects sessions that send more than 5 messages in a second
+					print_error("Rate must be under 5 messages per second");
+					return -1;
+				}
+				settings->bench_rate = value;
+			} else {
+				settings->bench_duration = value;
+			}
 		} else { 
 			print_error("Invalid argument");
 			return -1;
@@ -137,297 +774,3501 @@ int process_args(int argc, char *argv[], settings_t* settings) {
 }
 
 int get_username(settings_t* settings) {
-	// retrieves the username of the current user to login into mycord with
-	// returns -1 on success and 0 on failure
-	FILE* fp = popen("whoami", "r"); // runs the command whoami and reads from stdin
-	if (fp == NULL) { // checks if popen failed
-		print_error("popen failed");
-		return -1;
-	}
-	if (fgets(settings->username, sizeof(settings->username), fp) == NULL) { // stores username in settings and checks for failire
-		print_error("Failed to get username");
-		return -1;
+	// retrieves the username of the current user to login into mycord with, unless --username set one
+	// looks up the effective user id like whoami does, without starting a process for it
+	// returns 0 on success and -1 on failure
+	if (settings->username[0] != '\0') { // --username skips the passwd database entirely
+		return 0;
 	}
-	pclose(fp); // closes the file
-	// remove the new line 
-	size_t len = strnlen(settings->username, sizeof(settings->username));
-	if (len > 0 && settings->username[len-1] == '\n') { // checks for a new line character 
-		settings->username[len-1] = '\0'; // replaces it with null terminator
+
+	long suggested = sysconf(_SC_GETPW_R_SIZE_MAX);
+	size_t size = suggested > 0 ? (size_t)suggested : 1024;
+	while (true) {
+		char* buffer = malloc(size); // holds the strings the passwd entry points at
+		if (buffer == NULL) {
+			print_error("Failed to allocate username buffer");
+			return -1;
+		}
+		struct passwd entry;
+		struct passwd* found = NULL;
+		int error = getpwuid_r(geteuid(), &entry, buffer, size, &found);
+		if (error == ERANGE) { // the entry didn't fit, tries again with a bigger buffer
+			free(buffer);
+			size *= 2;
+			continue;
+		}
+		if (found == NULL) {
+			print_error(error != 0 ? strerror(error) : "No passwd entry for the current user");
+			print_error("Failed to get username");
+			free(buffer);
+			return -1;
+		}
+		strncpy(settings->username, found->pw_name, sizeof(settings->username) - 1); // long names are cut short like before
+		settings->username[sizeof(settings->username) - 1] = '\0';
+		free(buffer);
+		return 0;
 	}
-	return 0;
 }
 
 void handle_signal(int signal) {
 	// called to handle signals
 	if (signal == SIGINT || signal == SIGTERM) { 
 		settings.running = false;
+	} else if (signal == SIGUSR1) { // the summary is printed by the main thread
+		stats_requested = true;
+	} else if (signal == SIGALRM) { // --stats-interval timer
+		stats_line_due = true;
 	}
 	return;
 }
 
-ssize_t perform_full_write(const void* buf, size_t n, int socket_fd) { 
-	// performs a full write to the server
-	size_t total_written = 0;
+uint64_t monotonic_ns() {
+	// current CLOCK_MONOTONIC time in nanoseconds, used for every timing measurement
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
 
-	while (total_written < n) { 
-		ssize_t bytes_written = write(socket_fd, (const char*)buf+total_written, n-total_written); // writes to the socket
-		if (bytes_written == -1) { // checks if the write failed
-			if (errno == EINTR) { // signal interrupt 
-				continue;
-			}
-			print_error(strerror(errno)); 
-			return -1; 
-		}
-		if (bytes_written == 0) { // cant write anymore
-			return total_written; 
-		}
-		total_written += bytes_written; // increases total wrote
+uint64_t earliest_deadline(uint64_t a, uint64_t b) {
+	// the sooner of two monotonic deadlines where 0 means none
+	if (a == 0 || (b != 0 && b < a)) {
+		return b;
 	}
-	return total_written;
+	return a;
 }
 
-ssize_t perform_full_read(void* buf, size_t n, int socket_fd) {
-	// ensures a full read from the server
-	size_t total_read = 0; // stores total elements read 
+int timeout_until(uint64_t deadline_ns) {
+	// converts an absolute monotonic deadline into an epoll timeout in milliseconds (rounded up)
+	uint64_t now = monotonic_ns();
+	if (deadline_ns <= now) {
+		return 0;
+	}
+	return (int)((deadline_ns - now + 999999) / 1000000);
+}
 
-	while (total_read < n) { 
-		ssize_t bytes_read = read(socket_fd, (char*)buf+total_read, n-total_read); // read from socket
-		if (bytes_read == -1) { // checks if read failed
+ssize_t perform_full_writev(struct iovec* iov, int iovcnt, int socket_fd, stats_t* stats) {
+	// performs a full vectored write to the server, picking up partial writes in the middle of an iovec
+	// the iovecs are advanced in place, stats may be NULL
+	// returns the total number of bytes written or -1 on failure
+	static stats_t ignored; // counters of writes nobody is tracking
+	if (stats == NULL) {
+		stats = &ignored;
+	}
+	size_t total_written = 0;
+
+	while (iovcnt > 0) {
+		ssize_t bytes_written = writev(socket_fd, iov, iovcnt); // writes all the iovecs to the socket
+		stats->write_calls++;
+		if (bytes_written == -1) { // checks if the write failed
 			if (errno == EINTR) { // signal interrupt
+				stats->write_retries++;
 				continue;
 			}
 			print_error(strerror(errno));
 			return -1;
-		} 
-		if (bytes_read == 0) { // not reading anymore
-			return total_read;
 		}
-		total_read+=bytes_read; // increases total read
+		if (bytes_written == 0) { // cant write anymore
+			return total_written;
+		}
+		total_written += bytes_written; // increases total wrote
+		stats->bytes_written += bytes_written;
+
+		// skips the iovecs that were written completely
+		while (iovcnt > 0 && (size_t)bytes_written >= iov->iov_len) {
+			bytes_written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) { // moves past the part of the current iovec that was written
+			stats->short_writes++;
+			iov->iov_base = (char*)iov->iov_base + bytes_written;
+			iov->iov_len -= bytes_written;
+		}
 	}
-	return total_read;
+	return total_written;
 }
 
-void* receive_messages_thread(void* arg) {
-	// worker thread to receive messages from the server
-	// while some condition(s) are true
-	settings_t* settings = (settings_t*) arg; // casts the settings from the argument
-	if (settings == NULL) { // checks if arg is null
-	       print_error("Failed to pass settings to worker");
-	       pthread_exit((void*)1);
-    	}	       
-
-	while (settings->running) { // does work as long as the client is connected to the server
-		message_t message; // new message struct
+ssize_t perform_full_write(const void* buf, size_t n, int socket_fd, stats_t* stats) { 
+	// performs a full write of a single buffer to the server
+	struct iovec iov = { .iov_base = (void*)buf, .iov_len = n };
+	return perform_full_writev(&iov, 1, socket_fd, stats);
+}
 
-		// read message from the server (ensure no short reads)
-		ssize_t size = perform_full_read(&message, sizeof(message_t), settings->socket_fd); 
+void frame_prepare(const session_t* session, outbound_frame_t* frame, message_type_t type, const char* username, const char* text, size_t length) {
+	// points the frame's iovecs at the header, the username and text in place, and the shared zero padding
+	// compact frames (once the server acknowledged them) are a compact header followed by the username and text
+	// username may be NULL, text must be at most 1023 bytes so the frame stays null terminated
+	size_t username_length = username == NULL ? 0 : strnlen(username, sizeof(((message_t*)0)->username) - 1);
+	bool compact = session->compact;
+	frame->iovcnt = 0;
 
-		if (size != sizeof(message_t)) { // checks for an incomplete read
-			if (!settings->running) { // checks to see if the server is shut down
-				break;
-			}
-			print_error("Failed to read message from server");
-			pthread_exit((void*)1);
-		}
-		
-		// convert from network to host byte order
-		message.message_type = ntohl(message.message_type); 
-		message.timestamp = ntohl(message.timestamp);
-
-		// check the message type
-		if (message.message_type == MESSAGE_RECV) { // checks if the message from the server is MESSAGE_RECV type
-			// convert the timestamp to a printable time
-			time_t t = (time_t) message.timestamp; 
-			struct tm *time = localtime(&t);
-			char time_str[64]; 
-			strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", time); 
-			
-			if (settings->quiet) { // checks if the quiet parameter was specified
-				printf("[%s] %s: %s\n", time_str, message.username, message.message);
-			} else {
-                                printf("[%s] %s: ", time_str, message.username);
-				char compare[34] = "@"; // used to check for the mention
-				strncat(compare, settings->username, 33); // concats "@" and the persons username together
-				size_t length = strnlen(message.message, 1024); // length of the message
-				size_t username_length = strnlen(compare, 33); // length of the username plus the @ symbol
-				bool mentioned = false; 
-
-				for (size_t i = 0; i<length; ) { 
-					if (i+username_length <= length && strncmp(&(message.message[i]), compare, username_length) == 0) { 
-						// checks if current position plus username_length is still in bounds
-						// compares the current string and the username to see if they match
-						if (!mentioned) { // checks if there hasnt been a mention yet
-							printf("\a"); // sends the bell character
-						}
-						mentioned = true; // sets mentioned to true so the bell only gets sent once
-						printf("%s%s%s", COLOR_RED, compare, COLOR_RESET); // prints the highlighted username to stdout
-						i+=username_length; // increments i by username length
-					} else { 
-						printf("%c", message.message[i]); // prints the current character to stdout
-						i++;
-					}
-				}
-				printf("\n"); // adds a new line
-			}
-		} else if (message.message_type == DISCONNECT) { // checks if the message from the server is DISCONNECT type
-			printf("%s[DISCONNECT] %s%s\n", COLOR_RED, message.message, COLOR_RESET); // prints the disconnect message to stdout
-			settings->running = false; // stops reading
-			break;
-		} else if (message.message_type == SYSTEM) { // checks if the message from the server is SYSTEM type
-			printf("%s[SYSTEM] %s%s\n", COLOR_GRAY, message.message, COLOR_RESET); // prints the disconnect message to stdout
-		} else { // invalid inbound message
-			print_error("Invalid inbound message from server"); 
-			pthread_exit((void*)1);
-		}
+	if (compact) {
+		frame->compact_header = (compact_header_t){
+			.message_type = COMPACT_FLAG | (uint8_t)type,
+			.username_length = (uint8_t)username_length,
+			.message_length = htons((uint16_t)length),
+			.timestamp = 0,
+		};
+		frame->iov[frame->iovcnt++] = (struct iovec){ .iov_base = &frame->compact_header, .iov_len = sizeof(frame->compact_header) };
+		frame->length = sizeof(frame->compact_header) + username_length + length;
+	} else {
+		frame->header = (message_header_t){ .message_type = htonl(type), .timestamp = 0 };
+		frame->iov[frame->iovcnt++] = (struct iovec){ .iov_base = &frame->header, .iov_len = sizeof(frame->header) };
+		frame->length = sizeof(message_t);
+	}
+	if (username_length > 0) {
+		frame->iov[frame->iovcnt++] = (struct iovec){ .iov_base = (void*)username, .iov_len = username_length };
+	}
+	if (!compact) {
+		frame->iov[frame->iovcnt++] = (struct iovec){ .iov_base = (void*)ZERO_PADDING, .iov_len = sizeof(((message_t*)0)->username) - username_length };
+	}
+	if (length > 0) {
+		frame->iov[frame->iovcnt++] = (struct iovec){ .iov_base = (void*)text, .iov_len = length };
+	}
+	if (!compact) {
+		frame->iov[frame->iovcnt++] = (struct iovec){ .iov_base = (void*)ZERO_PADDING, .iov_len = sizeof(((message_t*)0)->message) - length };
 	}
-	return NULL; 
 }
 
-int main(int argc, char *argv[]) {
-	// setup sigactions (ill-advised to use signal for this project, use sigaction with default (0) flags instead)
-	struct sigaction sa = {0}; 
-	sa.sa_handler = handle_signal;
-	if (sigaction(SIGINT, &sa, NULL) == -1) { // sets up SIGINT handler and checks for error
-		print_error("Failure to setup SIGINT signal handler");
+void keepalive_schedule(session_t* session, bool spread) {
+	// sets when the session's next KEEPALIVE is due, a little before the interval so jitter never makes it late
+	// spread picks anywhere in the second half of the interval so sessions that logged in together drift apart
+	double interval_ns = settings.keepalive_interval * 1e9;
+	double fraction = (double)random() / RAND_MAX;
+	double delay_ns = spread ? interval_ns * (0.5 + 0.5 * fraction) : interval_ns * (0.9 + 0.1 * fraction);
+	session->keepalive_ns = monotonic_ns() + (uint64_t)delay_ns;
+}
+
+int uring_queue_send(uring_t* uring, session_t* session, const outbound_frame_t* frame) {
+	// copies a frame into a free send slot and appends it to the session's pending list,
+	// it is submitted (linked behind the session's other pending frames) at the top of the next event loop iteration
+	// returns 0 on success and -1 if every send slot is in use
+	uint32_t slot = uring->send_free;
+	if (slot == URING_NONE) {
+		print_error("Too many frames waiting for io_uring");
 		return -1;
 	}
-	if (sigaction(SIGTERM, &sa, NULL) == -1) { // sets up SIGTERM handler and checks for error
-		print_error("Failure to setup SIGTERM signal handler"); 
-		return -1;
+	uring_send_t* send = &uring->sends[slot];
+	uring->send_free = send->next;
+	send->length = 0;
+	for (int i = 0; i < frame->iovcnt; i++) {
+		memcpy(send->data + send->length, frame->iov[i].iov_base, frame->iov[i].iov_len);
+		send->length += frame->iov[i].iov_len;
 	}
-	
-	// set up default settings
-	settings.server.sin_family = AF_INET; // defaults address family to IPv4
-	settings.server.sin_port = htons(8080); // defaults port to 8080 in network byte order
-	settings.quiet = false; // defaults quiet to false
-	settings.socket_fd = -1; // defaults the socket to -1
-	settings.running = false; // defaults running to false
-	inet_pton(AF_INET, "127.0.0.1", &(settings.server.sin_addr)); // defaults ip address to 127.0.0.1
+	send->session = session;
+	send->generation = session->uring_generation;
+	send->next = URING_NONE;
+	if (session->send_head == URING_NONE) {
+		session->send_head = slot;
+	} else {
+		uring->sends[session->send_tail].next = slot;
+	}
+	session->send_tail = slot;
+	if (!session->send_dirty) {
+		session->send_dirty = true;
+		uring->dirty[uring->dirty_count++] = session;
+	}
+	return 0;
+}
 
-	// parse arguments
-	if (process_args(argc, argv, &settings) == -1) { // checks if processing arguments failed  
-		close(settings.socket_fd);
+int send_message(session_t* session, message_type_t type, const char* username, const char* text, size_t length) {
+	// sends a frame without building it in memory first, everything goes out in one writev
+	// (or with --io-uring in the next submission)
+	// returns 0 on success and -1 on failure
+	outbound_frame_t frame;
+	frame_prepare(session, &frame, type, username, text, length);
+	if (uring.fd != -1) {
+		if (uring_queue_send(&uring, session, &frame) == -1) {
+			return -1;
+		}
+	} else if (perform_full_writev(frame.iov, frame.iovcnt, session->socket_fd, &session->stats) != (ssize_t)frame.length) { // checks if the full write failed
 		return -1;
 	}
+	session->stats.frames_written++;
+	if (session->keepalive) { // any frame resets the server's idle timeout
+		keepalive_schedule(session, false);
+	}
+	return 0;
+}
 
-	// get username
-	if (get_username(&settings) == -1) { // checks if get_username failed
-                close(settings.socket_fd);
+int send_messages(session_t* session, const char* const* texts, const size_t* lengths, size_t count) {
+	// sends up to RATE_LIMIT_MESSAGES MESSAGE_SEND frames in a single writev
+	// returns 0 on success and -1 on failure
+	outbound_frame_t frames[RATE_LIMIT_MESSAGES];
+	struct iovec iov[RATE_LIMIT_MESSAGES * 5];
+	int iovcnt = 0;
+	size_t total = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		frame_prepare(session, &frames[i], MESSAGE_SEND, NULL, texts[i], lengths[i]);
+		memcpy(iov + iovcnt, frames[i].iov, frames[i].iovcnt * sizeof(struct iovec));
+		iovcnt += frames[i].iovcnt;
+		total += frames[i].length;
+	}
+	if (perform_full_writev(iov, iovcnt, session->socket_fd, &session->stats) != (ssize_t)total) { // checks if the full write failed
 		return -1;
 	}
+	session->stats.frames_written += count;
+	return 0;
+}
 
-	// create socket
-	settings.socket_fd = socket(AF_INET, SOCK_STREAM, 0); // creates a IPv4 socket using default TCP/Stream Protocol
-	if (settings.socket_fd == -1) { // checks if creating the socket failed
-		print_error("Failure to create the socket");
-                close(settings.socket_fd);
-		return -1;
-	}	
+void send_refill(send_queue_t* queue, uint64_t now) {
+	// brings the session's token bucket up to date
+	double tokens = queue->tokens + (now - queue->refilled_ns) / 1e9 * settings.send_rate;
+	queue->tokens = tokens < settings.send_burst ? tokens : settings.send_burst;
+	queue->refilled_ns = now;
+}
 
-	// connect to server
-	if (connect(settings.socket_fd, (const struct sockaddr*)&(settings.server), sizeof(settings.server)) == -1) {
-		// checks if connecting to the server failed
-		print_error(strerror(errno));
-		close(settings.socket_fd);
-		return -1; 
+uint64_t send_queue_due(const send_queue_t* queue) {
+	// monotonic time the oldest queued line gets its token, 0 if nothing is queued
+	if (queue->count == 0) {
+		return 0;
 	}
-	settings.running = true; // sets running to true after connecting to the server
-
-	// creates the login message
-	message_t login_message = {
-		.message_type = LOGIN, // Type 0 LOGIN [OUTBOUND]
-	};
-	// sets the username of the message to current username from settings 
-	if (strncpy(login_message.username, settings.username, 31) == NULL) { // checks if strncpy failed
-		print_error("Failed to copy username from setings"); 
-		close(settings.socket_fd);
-		return -1; 
+	if (queue->tokens >= 1) {
+		return queue->refilled_ns;
 	}
-	login_message.username[31] = '\0';
-	login_message.message_type = htonl(login_message.message_type); // converts the message type to network byte order
+	return queue->refilled_ns + (uint64_t)((1 - queue->tokens) / settings.send_rate * 1e9) + 1;
+}
 
-	// sends the login message
-	if (write(settings.socket_fd, &login_message, sizeof(login_message)) <= 0) { // checks if the message failed to send
-		print_error("Failed to write to server");
-		print_error(strerror(errno)); 
-		close(settings.socket_fd); // closes the socket
-		return -1;
+int send_queue_push(session_t* session, const char* text, size_t length) {
+	// queues a validated line (at most 1023 bytes) behind the ones already waiting for the rate limit
+	// returns 0 once queued and 1 if the queue is full
+	send_queue_t* queue = &session->send_queue;
+	if (queue->count == SEND_QUEUE_CAPACITY) {
+		return 1;
 	}
+	send_refill(queue, monotonic_ns());
+	if (queue->count > 0 || queue->tokens < 1) { // this one has to wait
+		session->stats.sends_paced++;
+	}
+	size_t slot = (queue->head + queue->count) % SEND_QUEUE_CAPACITY;
+	memcpy(queue->texts[slot], text, length);
+	queue->lengths[slot] = length;
+	queue->count++;
+	session->stats.send_queued = queue->count;
+	if (queue->count > session->stats.send_queue_max) {
+		session->stats.send_queue_max = queue->count;
+	}
+	return 0;
+}
 
-	// create and start receive messages thread
-	void* status; // stores the status of the exited thread
-	pthread_t receive_messages; // declare a new thread
-
-	// creates a worker thread
-	if (pthread_create(&receive_messages, NULL, receive_messages_thread, &settings) != 0) { // checks for failure
-		print_error("Failed to create recieve messages thread");
-		close(settings.socket_fd);
-		return -1;
+int send_queue_release(session_t* session) {
+	// sends the queued lines the token bucket has tokens for, oldest first
+	// nothing goes out while the session is logged out (e.g. waiting to reconnect)
+	// returns 0 on success and -1 if writing to the server failed
+	send_queue_t* queue = &session->send_queue;
+	if (queue->count == 0 || session->logged_out || session->socket_fd == -1) {
+		return 0;
 	}
-	
-	char input_buffer[1024];
-	while (settings.running) {
-		// reads a line from stdin
-		if (fgets(input_buffer, sizeof(input_buffer), stdin) == NULL) { // checks for failure or EOF
-			break;
-		}
-		if (!settings.running) { // checks if disconnected
-			break;
-		}
-		
-		// get rid of newline character
-		size_t len = strnlen(input_buffer, sizeof(input_buffer));
-		if (len > 0 && input_buffer[len-1] == '\n') { // checks for new line character
-			input_buffer[len-1] = '\0'; // replaces new line with null terminator
-			len--; // updates the length 
+	send_refill(queue, monotonic_ns());
+	while (queue->count > 0 && queue->tokens >= 1) {
+		if (send_message(session, MESSAGE_SEND, NULL, queue->texts[queue->head], queue->lengths[queue->head]) == -1) {
+			return -1;
 		}
+		queue->tokens -= 1;
+		queue->head = (queue->head + 1) % SEND_QUEUE_CAPACITY;
+		queue->count--;
+	}
+	session->stats.send_queued = queue->count;
+	return 0;
+}
 
-		if (len < 1 || len > 1023) { // checks for invalid size
-			print_error("Message must be between 1 amnd 1023 characters");
-			continue; // skips invalid message 
-		}
+void send_learn(const char* reason) {
+	// lowers the pacing of every session to the limit a rate limit DISCONNECT states:
+	// "Too many messages (rate R/s, burst B)" is the server's token bucket, a tenth of R is left for network jitter
+	if (strncmp(reason, RATE_LIMIT_REASON, strlen(RATE_LIMIT_REASON)) != 0) {
+		return;
+	}
+	char* end;
+	double limit = strtod(reason + strlen(RATE_LIMIT_REASON), &end);
+	if (!(limit > 0) || strncmp(end, "/s, burst ", 10) != 0) {
+		return;
+	}
+	long burst = strtol(end + 10, &end, 10);
+	if (burst < 1 || strcmp(end, ")") != 0) {
+		return;
+	}
+	double rate = limit * 0.9;
+	if ((unsigned long)burst < settings.send_burst) {
+		settings.send_burst = (unsigned int)burst;
+	}
+	if (rate < settings.send_rate) {
+		settings.send_rate = rate;
+	}
+}
 
-		bool valid = true;
-		for (size_t i = 0; i<len; i++) { // loops through the inputted string
-			if (input_buffer[i] == '\n') { // checks for a new line character in the middle of the input
-				print_error("Message cannot contain newlines");
-				valid = false;
-				break; // skips checking the rest of the message
-			}
-			if (!isprint((unsigned char)input_buffer[i])) { // checks if the character is printable
-				print_error("Message must contain printable characters only");
-				valid = false;
-				break; // skips checking the rest of the message
+ssize_t receive_fill(receive_buffer_t* receive, int socket_fd, stats_t* stats) {
+	// reads as much as the socket has (up to the free space in the buffer) with one read
+	// returns the number of bytes read, 0 when the server closed the connection and -1 on failure
+	if (receive->start > 0) { // moves the partial frame left over from the last read to the front
+		memmove(receive->data, receive->data + receive->start, receive->end - receive->start);
+		receive->end -= receive->start;
+		receive->start = 0;
+	}
+
+	while (true) {
+		ssize_t bytes_read = read(socket_fd, receive->data + receive->end, RECEIVE_BUFFER_SIZE - receive->end); // read from socket
+		stats->read_calls++;
+		if (bytes_read == -1) { // checks if read failed
+			if (errno == EINTR) { // signal interrupt
+				stats->read_retries++;
+				continue;
 			}
+			print_error(strerror(errno));
+			return -1;
 		}
-		if (!valid) { // checks if the message wasn't valid
-			continue; // skips the invalid message 
-		}
-
-		message_t outbound_message = {0}; // creates a new message
-		outbound_message.message_type = htonl(MESSAGE_SEND); // sets message type to MESSAGE_SEND in network byte order
-		strncpy(outbound_message.message, input_buffer, 1023); // copies the input buffer over
-		outbound_message.message[1023] = '\0'; // makes sure its null terminated
+		receive->end += bytes_read; // increases total read
+		stats->bytes_read += bytes_read;
+		return bytes_read;
+	}
+}
 
-		// sends the message to server
-		if (perform_full_write(&outbound_message, sizeof(outbound_message), settings.socket_fd) != sizeof(outbound_message)) {
-		       	// checks if the full write failed
-		      	print_error("Failed to write to server");
-			break;	       
+message_t* receive_next_frame(receive_buffer_t* receive, message_t* decoded) {
+	// splits the next complete frame out of the buffer, fixed size frames are used in place without copying
+	// and compact ones are expanded into decoded since their layout differs from message_t
+	// converts the header to host byte order, returns NULL if no complete frame is buffered
+	size_t available = receive->end - receive->start;
+	if (available > 0 && ((uint8_t)receive->data[receive->start] & COMPACT_FLAG)) { // compact frame
+		compact_header_t header;
+		if (available < sizeof(header)) { // checks for a partial header
+			return NULL;
 		}
-	}	 
-  	settings.running = false; // EOF or error
-	
-	if (settings.socket_fd != -1) { // checks to make sure the socket is still open
-		
-		message_t logout_message = {0}; // creates a logout message
-		logout_message.message_type = htonl(LOGOUT); // sets message type to LOGOT in network byte order
-		if (perform_full_write(&logout_message, sizeof(logout_message), settings.socket_fd) != sizeof(logout_message)) { 
-			// checks if full write failed
-			print_error("Failed to send logout message to server");
-			close(settings.socket_fd);
-			return -1; 
+		memcpy(&header, receive->data + receive->start, sizeof(header));
+		size_t message_length = ntohs(header.message_length);
+		size_t length = sizeof(header) + header.username_length + message_length;
+		if (available < length) { // checks for a partial frame
+			return NULL;
+		}
+		message_t* message = decoded;
+		if (header.username_length >= sizeof(message->username) || message_length >= sizeof(message->message)) {
+			message->message_type = UINT32_MAX; // reported as an invalid inbound message
+		} else {
+			const char* body = receive->data + receive->start + sizeof(header);
+			message->message_type = header.message_type & ~COMPACT_FLAG;
+			message->timestamp = ntohl(header.timestamp);
+			memcpy(message->username, body, header.username_length);
+			message->username[header.username_length] = '\0';
+			memcpy(message->message, body + header.username_length, message_length);
+			message->message[message_length] = '\0';
 		}
+		receive->start += length;
+		return message;
+	}
+
+	if (available < sizeof(message_t)) { // checks for a partial frame
+		return NULL;
+	}
+	message_t* message = (message_t*)(receive->data + receive->start); // packed struct so any offset is fine
+	receive->start += sizeof(message_t);
+
+	// convert from network to host byte order
+	message->message_type = ntohl(message->message_type);
+	message->timestamp = ntohl(message->timestamp);
+	return message;
+}
+
+void mention_init(mention_pattern_t* mention, const char* username) {
+	// builds the "@username" pattern once so it isn't rebuilt for every message
+	mention->pattern[0] = '@';
+	size_t length = strnlen(username, sizeof(mention->pattern) - 2); // leaves room for the @ and null terminator
+	memcpy(mention->pattern + 1, username, length);
+	mention->pattern[length + 1] = '\0';
+	mention->length = length + 1;
+}
+
+size_t mention_scan(const mention_pattern_t* mention, const char* text, size_t length, size_t* offsets, size_t max_offsets) {
+	// finds every non overlapping mention in text and stores its offset in offsets
+	// jumps between '@' candidates with memchr (vectorized in libc) instead of comparing at every byte
+	// returns the number of mentions found
+	size_t count = 0;
+	size_t i = 0; // first offset that can still start a mention
+
+	while (count < max_offsets && i + mention->length <= length) {
+		// only searches offsets where a full mention still fits in the text
+		const char* at = memchr(text + i, '@', length - mention->length + 1 - i);
+		if (at == NULL) { // no more candidates
+			break;
+		}
+		size_t offset = (size_t)(at - text);
+		if (memcmp(at + 1, mention->pattern + 1, mention->length - 1) == 0) { // checks the rest of the username
+			offsets[count++] = offset;
+			i = offset + mention->length; // mentions don't overlap
+		} else {
+			i = offset + 1;
+		}
+	}
+	return count;
+}
+
+const char* format_timestamp(timestamp_cache_t* cache, time_t t, size_t* length) {
+	// formats t as "%Y-%m-%d %H:%M:%S" in local time
+	// within the cached minute only the seconds digits are rewritten, otherwise localtime_r fills the cache again
+	// returns the cached text and stores its length in length
+	if (cache->valid && t >= cache->minute_start && t < cache->minute_start + 60) {
+		int seconds = (int)(t - cache->minute_start);
+		cache->text[cache->length - 2] = (char)('0' + seconds / 10);
+		cache->text[cache->length - 1] = (char)('0' + seconds % 10);
+	} else {
+		struct tm time;
+		localtime_r(&t, &time); // thread safe and doesn't take the tz lock for every message
+		cache->length = strftime(cache->text, sizeof(cache->text), "%Y-%m-%d %H:%M:%S", &time);
+		cache->minute_start = t - time.tm_sec;
+		cache->valid = cache->length >= 2 && time.tm_sec < 60; // leap seconds don't follow the pattern
+	}
+	*length = cache->length;
+	return cache->text;
+}
+
+void render_append(renderer_t* renderer, const char* data, size_t n) {
+	// appends n bytes to the output buffer, callers make sure there is room with render_message
+	memcpy(renderer->buffer + renderer->length, data, n);
+	renderer->length += n;
+}
+
+void render_append_str(renderer_t* renderer, const char* str) {
+	// appends a null terminated string to the output buffer
+	render_append(renderer, str, strlen(str));
+}
+
+int render_flush(renderer_t* renderer) {
+	// writes everything in the output buffer to stdout with a single write
+	// returns 0 on success and -1 on failure
+	if (renderer->length == 0) { // nothing to write
+		return 0;
+	}
+	ssize_t written = perform_full_write(renderer->buffer, renderer->length, STDOUT_FILENO, NULL);
+	size_t length = renderer->length;
+	renderer->length = 0; // the buffer is reused for the next batch either way
+	renderer->rang = false;
+	renderer->flushed_ns = settings.refresh_ms ? monotonic_ns() : 0;
+	if (written < 0 || (size_t)written != length) { // checks if the full write failed
+		return -1;
+	}
+	return 0;
+}
+
+int render_message(renderer_t* renderer, const message_t* message, const mention_pattern_t* mention) {
+	// formats a host byte order message into the output buffer as one complete line
+	// mentions of the pattern are highlighted, NULL disables highlighting (--quiet)
+	// flushes first if the line might not fit, returns the number of mentions highlighted or -1 on failure
+	if (RENDER_BUFFER_SIZE - renderer->length < RENDER_LINE_MAX && render_flush(renderer) == -1) {
+		return -1;
+	}
+	size_t length = strnlen(message->message, sizeof(message->message)); // length of the message
+	size_t count = 0; // mentions highlighted
+
+	if (message->message_type == MESSAGE_RECV) { // chat message from a user
+		// convert the timestamp to a printable time
+		size_t time_length;
+		const char* time_str = format_timestamp(&renderer->clock, (time_t) message->timestamp, &time_length);
+
+		render_append(renderer, "[", 1);
+		render_append(renderer, time_str, time_length);
+		render_append(renderer, "] ", 2);
+		render_append(renderer, message->username, strnlen(message->username, sizeof(message->username)));
+		render_append(renderer, ": ", 2);
+
+		if (mention == NULL) { // checks if the quiet parameter was specified
+			render_append(renderer, message->message, length);
+		} else {
+			size_t offsets[MENTION_MAX]; // offsets of every mention in the message
+			count = mention_scan(mention, message->message, length, offsets, MENTION_MAX);
+			size_t plain_start = 0; // start of the run of text that has not been copied yet
+
+			for (size_t i = 0; i<count; i++) { // copies the text before each mention and then the highlighted mention
+				render_append(renderer, message->message + plain_start, offsets[i] - plain_start);
+				if (i == 0 && !renderer->rang) { // the bell only gets sent before the first mention of the whole batch
+					render_append(renderer, "\a", 1);
+					renderer->rang = true;
+				}
+				render_append_str(renderer, COLOR_RED);
+				render_append(renderer, mention->pattern, mention->length);
+				render_append_str(renderer, COLOR_RESET);
+				plain_start = offsets[i] + mention->length;
+			}
+			render_append(renderer, message->message + plain_start, length - plain_start); // copies the rest
+		}
+		render_append(renderer, "\n", 1); // adds a new line
+	} else if (message->message_type == DISCONNECT) { // red disconnect reason
+		render_append_str(renderer, COLOR_RED);
+		render_append(renderer, "[DISCONNECT] ", 13);
+		render_append(renderer, message->message, length);
+		render_append_str(renderer, COLOR_RESET);
+		render_append(renderer, "\n", 1);
+	} else if (message->message_type == SYSTEM) { // gray system message
+		render_append_str(renderer, COLOR_GRAY);
+		render_append(renderer, "[SYSTEM] ", 9);
+		render_append(renderer, message->message, length);
+		render_append_str(renderer, COLOR_RESET);
+		render_append(renderer, "\n", 1);
+	}
+	return (int)count;
+}
+
+uint64_t render_deadline(const renderer_t* renderer) {
+	// monotonic time buffered output has to be written by with --refresh-ms, 0 if nothing is held back
+	if (settings.refresh_ms == 0 || renderer->length == 0) {
+		return 0;
+	}
+	return renderer->flushed_ns + settings.refresh_ms * 1000000ULL;
+}
+
+bool render_due(const renderer_t* renderer) {
+	// whether the buffered output may be written now, always without --refresh-ms
+	uint64_t deadline = render_deadline(renderer);
+	return deadline == 0 || monotonic_ns() >= deadline;
+}
+
+void render_skipped(renderer_t* renderer) {
+	// tells the user how many chat messages were skipped to catch up since the last notice
+	if (renderer->skipped == 0) {
+		return;
+	}
+	message_t notice = { .message_type = SYSTEM };
+	snprintf(notice.message, sizeof(notice.message), "%zu messages skipped", renderer->skipped);
+	renderer->skipped = 0;
+	render_message(renderer, &notice, NULL);
+}
+
+
+void frame_pool_init(frame_pool_t* pool) {
+	// puts every slot on the free list
+	for (uint32_t i = 0; i < FRAME_POOL_SLOTS; i++) {
+		atomic_init(&pool->refs[i], 0);
+		pool->next[i] = i + 1 < FRAME_POOL_SLOTS ? i + 1 : FRAME_POOL_NONE;
+	}
+	atomic_init(&pool->free_head, 0); // tag 0, slot 0
+}
+
+uint32_t frame_pool_acquire(frame_pool_t* pool) {
+	// pops a free slot holding one reference for the caller, FRAME_POOL_NONE if every slot is in use
+	uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_acquire);
+	while (true) {
+		uint32_t slot = (uint32_t)head;
+		if (slot == FRAME_POOL_NONE) {
+			return FRAME_POOL_NONE;
+		}
+		uint64_t next = ((head >> 32) + 1) << 32 | pool->next[slot]; // a new tag so an ABA reuse of the head fails
+		if (atomic_compare_exchange_weak_explicit(&pool->free_head, &head, next, memory_order_acquire, memory_order_acquire)) {
+			atomic_store_explicit(&pool->refs[slot], 1, memory_order_relaxed);
+			return slot;
+		}
+	}
+}
+
+void frame_pool_ref(frame_pool_t* pool, uint32_t slot) {
+	// adds a reference for another stage that will use the slot
+	atomic_fetch_add_explicit(&pool->refs[slot], 1, memory_order_relaxed);
+}
+
+void frame_pool_release(frame_pool_t* pool, uint32_t slot) {
+	// drops a reference, the last one pushes the slot back on the free list
+	if (atomic_fetch_sub_explicit(&pool->refs[slot], 1, memory_order_acq_rel) != 1) {
+		return;
+	}
+	uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_relaxed);
+	uint64_t next;
+	do {
+		pool->next[slot] = (uint32_t)head;
+		next = ((head >> 32) + 1) << 32 | slot;
+	} while (!atomic_compare_exchange_weak_explicit(&pool->free_head, &head, next, memory_order_release, memory_order_relaxed));
+}
+
+int frame_queue_init(frame_queue_t* queue) {
+	// sets up an empty queue, returns 0 on success and -1 on failure
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	atomic_init(&queue->closed, false);
+	atomic_init(&queue->consumer_done, false);
+	atomic_init(&queue->dropped, 0);
+	if (sem_init(&queue->ready, 0, 0) == -1) {
+		print_error(strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+bool frame_queue_push(frame_queue_t* queue, uint32_t slot) {
+	// hands a frame pool slot and the reference that comes with it to the render thread (receive thread only)
+	// returns false without blocking if the queue is full
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&queue->head, memory_order_acquire); // the slot was rendered before head moved
+	if (tail - head == FRAME_QUEUE_CAPACITY) { // full
+		return false;
+	}
+	queue->slots[tail & (FRAME_QUEUE_CAPACITY - 1)] = slot;
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release); // publishes the slot and the frame in it
+	sem_post(&queue->ready);
+	return true;
+}
+
+uint32_t frame_queue_peek(frame_queue_t* queue) {
+	// returns the pool slot of the oldest queued frame without removing it (render thread only), FRAME_POOL_NONE if empty
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	if (head == tail) {
+		return FRAME_POOL_NONE;
+	}
+	return queue->slots[head & (FRAME_QUEUE_CAPACITY - 1)];
+}
+
+void frame_queue_pop(frame_queue_t* queue) {
+	// removes the frame returned by frame_queue_peek, its slot reference now belongs to the render thread (render thread only)
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+size_t frame_queue_depth(frame_queue_t* queue) {
+	// frames waiting behind the one the render thread just took (render thread only)
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	return atomic_load_explicit(&queue->tail, memory_order_acquire) - head;
+}
+
+void frame_queue_close(frame_queue_t* queue) {
+	// tells the render thread that no more frames are coming
+	atomic_store(&queue->closed, true);
+	sem_post(&queue->ready);
+}
+
+session_t* session_create(const settings_t* settings, const char* username, bool render) {
+	// creates a session that will log in as username, nothing is connected yet
+	// returns NULL on failure
+	session_t* session = calloc(1, sizeof(session_t));
+	if (session == NULL) { // checks if calloc failed
+		print_error("Failed to allocate session");
+		return NULL;
+	}
+	session->socket_fd = -1; // not connected yet
+	strncpy(session->username, username, sizeof(session->username) - 1);
+	mention_init(&session->mention, session->username); // builds the mention pattern once for the session
+	session->quiet = settings->quiet;
+	session->compact_requested = settings->compact;
+	session->render = render;
+	session->reader.partial = FRAME_POOL_NONE;
+	session->send_head = URING_NONE;
+	session->send_tail = URING_NONE;
+	session->send_queue.tokens = settings->send_burst; // a full bucket, nothing was sent yet
+	session->send_queue.refilled_ns = monotonic_ns();
+	return session;
+}
+
+void session_destroy(session_t* session) {
+	// closes the session's socket and frees it
+	if (session == NULL) {
+		return;
+	}
+	if (session->socket_fd != -1) {
+		close(session->socket_fd);
+	}
+	free(session);
+}
+
+int connect_any(const settings_t* settings) {
+	// happy eyeballs over the resolved addresses: starts a non-blocking connect to the first one and another
+	// to the next address every HAPPY_EYEBALLS_DELAY_MS until one of them connects or the connect timeout passes
+	// returns the connected (blocking again) socket or -1 if every address failed
+	uint64_t deadline = monotonic_ns() + (uint64_t)(settings->connect_timeout * 1e9);
+	int fds[ADDRESS_MAX];
+	struct pollfd polled[ADDRESS_MAX];
+	size_t started = 0; // attempts started so far, one per address
+	size_t pending = 0; // attempts still in progress
+	int last_error = ECONNREFUSED;
+	int connected = -1;
+
+	while (connected == -1 && (started < settings->address_count || pending > 0)) {
+		if (started < settings->address_count) { // starts the next attempt
+			struct sockaddr_in address = settings->server;
+			address.sin_addr = settings->addresses[started];
+			int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+			if (fd != -1 && connect(fd, (const struct sockaddr*)&address, sizeof(address)) == 0) {
+				connected = fd; // connected right away (loopback)
+				break;
+			}
+			if (fd != -1 && errno == EINPROGRESS) {
+				pending++;
+			} else { // failed right away, moves on to the next address
+				last_error = errno;
+				if (fd != -1) {
+					close(fd);
+				}
+				fd = -1;
+			}
+			fds[started++] = fd;
+		}
+
+		// waits for any attempt to finish, or until the next address is due
+		size_t count = 0;
+		for (size_t i = 0; i < started; i++) {
+			if (fds[i] != -1) {
+				polled[count++] = (struct pollfd){ .fd = fds[i], .events = POLLOUT };
+			}
+		}
+		if (count == 0) {
+			continue;
+		}
+		int timeout = timeout_until(deadline);
+		if (timeout == 0) {
+			last_error = ETIMEDOUT;
+			break;
+		}
+		if (started < settings->address_count && timeout > HAPPY_EYEBALLS_DELAY_MS) {
+			timeout = HAPPY_EYEBALLS_DELAY_MS;
+		}
+		int ready = poll(polled, count, timeout);
+		if (ready == -1 && errno != EINTR) {
+			last_error = errno;
+			break;
+		}
+		for (size_t i = 0; ready > 0 && i < count && connected == -1; i++) {
+			if (polled[i].revents == 0) {
+				continue;
+			}
+			int error = 0;
+			socklen_t length = sizeof(error);
+			getsockopt(polled[i].fd, SOL_SOCKET, SO_ERROR, &error, &length);
+			for (size_t j = 0; j < started; j++) {
+				if (fds[j] == polled[i].fd) {
+					fds[j] = -1; // finished either way
+				}
+			}
+			pending--;
+			if (error == 0) {
+				connected = polled[i].fd;
+			} else {
+				last_error = error;
+				close(polled[i].fd);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < started; i++) { // abandons the attempts that lost the race
+		if (fds[i] != -1) {
+			close(fds[i]);
+		}
+	}
+	if (connected == -1) {
+		print_error(last_error == ETIMEDOUT ? "Timed out connecting to server" : strerror(last_error));
+		return -1;
+	}
+	fcntl(connected, F_SETFL, fcntl(connected, F_GETFL) & ~O_NONBLOCK); // the rest of the client expects blocking sockets
+	return connected;
+}
+
+int session_connect(session_t* session, const settings_t* settings) {
+	// opens a TCP connection to the server for the session, racing the addresses of a domain (see connect_any)
+	// returns 0 on success and -1 on failure
+	session->connect_started_ns = monotonic_ns();
+	session->socket_fd = connect_any(settings);
+	if (session->socket_fd == -1) {
+		return -1;
+	}
+	session->connected_ns = monotonic_ns();
+	return 0;
+}
+
+int session_login(session_t* session) {
+	// sends the LOGIN message for the session through the full write path
+	// servers that don't know compact framing ignore the message field
+	// returns 0 on success and -1 on failure
+	char capabilities[32];
+	int length = snprintf(capabilities, sizeof(capabilities), "%s%s%s", session->compact_requested ? CAPABILITY_COMPACT : "",
+		session->compact_requested && settings.keepalive_interval ? " " : "", settings.keepalive_interval ? CAPABILITY_KEEPALIVE : "");
+	session->login_sent_ns = monotonic_ns();
+	if (send_message(session, LOGIN, session->username, capabilities, (size_t)length) == -1) {
+		print_error("Failed to write to server");
+		return -1;
+	}
+	return 0;
+}
+
+int session_logout(session_t* session) {
+	// sends a LOGOUT message unless the session already logged out or was disconnected
+	// returns 0 on success and -1 on failure
+	if (session->logged_out || session->socket_fd == -1) {
+		return 0;
+	}
+	session->logged_out = true;
+	if (send_message(session, LOGOUT, NULL, NULL, 0) == -1) { // sends a logout message
+		print_error("Failed to send logout message to server");
+		return -1;
+	}
+	return 0;
+}
+
+cache_header_t* cache_header(const cache_t* cache) {
+	return (cache_header_t*)cache->map;
+}
+
+message_t* cache_frame(const cache_t* cache, size_t index) {
+	// the cached frame at index, frames are packed so any offset works
+	return (message_t*)(cache->map + sizeof(cache_header_t) + index * sizeof(message_t));
+}
+
+int cache_map(cache_t* cache, size_t capacity) {
+	// resizes the file to hold capacity frames and maps all of it
+	// returns 0 on success and -1 on failure
+	size_t size = sizeof(cache_header_t) + capacity * sizeof(message_t);
+	if (cache->map != NULL) {
+		munmap(cache->map, sizeof(cache_header_t) + cache->capacity * sizeof(message_t));
+		cache->map = NULL;
+	}
+	if (ftruncate(cache->fd, (off_t)size) == -1) {
+		print_error(strerror(errno));
+		return -1;
+	}
+	void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+	if (map == MAP_FAILED) {
+		print_error(strerror(errno));
+		return -1;
+	}
+	cache->map = map;
+	cache->capacity = capacity;
+	return 0;
+}
+
+void cache_close(cache_t* cache) {
+	// trims the preallocated space off the file and unmaps it
+	if (cache->fd == -1) {
+		return;
+	}
+	if (cache->map != NULL) {
+		size_t count = cache_header(cache)->frame_count;
+		munmap(cache->map, sizeof(cache_header_t) + cache->capacity * sizeof(message_t));
+		cache->map = NULL;
+		if (ftruncate(cache->fd, (off_t)(sizeof(cache_header_t) + count * sizeof(message_t))) == -1) {
+			print_error(strerror(errno));
+		}
+	}
+	close(cache->fd);
+	cache->fd = -1;
+}
+
+int cache_open(cache_t* cache, const char* path) {
+	// opens or creates the cache file and maps it, refusing files that aren't a cache from this build
+	// returns 0 on success and -1 on failure
+	cache->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (cache->fd == -1) {
+		print_error(strerror(errno));
+		print_error("Failed to open the message cache");
+		return -1;
+	}
+	struct stat info;
+	if (fstat(cache->fd, &info) == -1) {
+		print_error(strerror(errno));
+		cache_close(cache);
+		return -1;
+	}
+	bool created = info.st_size == 0;
+	if (!created && (size_t)info.st_size < sizeof(cache_header_t)) {
+		print_error("Message cache file is truncated");
+		cache_close(cache);
+		return -1;
+	}
+	size_t frames = created ? 0 : ((size_t)info.st_size - sizeof(cache_header_t)) / sizeof(message_t);
+	if (cache_map(cache, frames + CACHE_GROW_FRAMES) == -1) {
+		cache_close(cache);
+		return -1;
+	}
+
+	cache_header_t* header = cache_header(cache);
+	if (created) {
+		memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+		header->version = CACHE_VERSION;
+		header->frame_size = sizeof(message_t);
+		header->frame_count = 0;
+	} else if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 || header->version != CACHE_VERSION
+			|| header->frame_size != sizeof(message_t) || header->frame_count > frames) {
+		print_error("Not a message cache file (or from an incompatible version)");
+		munmap(cache->map, sizeof(cache_header_t) + cache->capacity * sizeof(message_t));
+		cache->map = NULL; // leaves the file as it was
+		close(cache->fd);
+		cache->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+size_t cache_lower_bound(const cache_t* cache, uint32_t timestamp) {
+	// binary search for the first cached frame at or after timestamp
+	size_t low = 0;
+	size_t high = cache_header(cache)->frame_count;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (cache_frame(cache, middle)->timestamp < timestamp) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+bool cache_contains(const cache_t* cache, const message_t* message) {
+	// checks whether a frame with the same timestamp, username and text is cached already
+	size_t count = cache_header(cache)->frame_count;
+	for (size_t i = cache_lower_bound(cache, message->timestamp); i < count; i++) {
+		const message_t* cached = cache_frame(cache, i);
+		if (cached->timestamp != message->timestamp) {
+			break;
+		}
+		if (strncmp(cached->username, message->username, sizeof(message->username)) == 0
+				&& strncmp(cached->message, message->message, sizeof(message->message)) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int cache_append(cache_t* cache, const message_t* message) {
+	// appends a MESSAGE_RECV frame unless it is one the cache already has (the history is replayed on every login)
+	// frames older than the newest cached one are skipped too so the timestamps stay sorted
+	// returns 1 if the frame was appended, 0 if it was skipped and -1 if the file could not grow
+	cache_header_t* header = cache_header(cache);
+	size_t count = header->frame_count;
+	if (count > 0 && (message->timestamp < cache_frame(cache, count - 1)->timestamp || cache_contains(cache, message))) {
+		return 0;
+	}
+	if (count == cache->capacity && cache_map(cache, cache->capacity + CACHE_GROW_FRAMES) == -1) {
+		return -1;
+	}
+	message_t* frame = cache_frame(cache, count);
+	memcpy(frame, message, sizeof(message_t));
+	frame->message_type = MESSAGE_RECV;
+	cache_header(cache)->frame_count = count + 1; // published after the frame so a crash never exposes half of one
+	return 1;
+}
+
+int cache_render(const cache_t* cache, size_t from, const mention_pattern_t* mention) {
+	// renders the cached frames from index from to the end, returns -1 if stdout failed
+	size_t count = cache_header(cache)->frame_count;
+	for (size_t i = from; i < count; i++) {
+		if (render_message(&renderer, cache_frame(cache, i), mention) == -1) {
+			return -1;
+		}
+	}
+	return render_flush(&renderer);
+}
+
+uint64_t frame_hash(const message_t* message) {
+	// FNV-1a over the username and text of a frame, tells apart messages sent within the same second
+	uint64_t hash = 14695981039346656037ULL;
+	for (const char* c = message->username; *c != '\0' && c < message->username + sizeof(message->username); c++) {
+		hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+	}
+	hash = (hash ^ 0xff) * 1099511628211ULL; // separates the username from the text
+	for (const char* c = message->message; *c != '\0' && c < message->message + sizeof(message->message); c++) {
+		hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+bool session_seen(session_t* session, const message_t* message) {
+	// remembers the newest MESSAGE_RECV frames that were rendered and reports whether this one was already shown
+	// while resuming, history older than the newest rendered second is a duplicate, within it the hashes decide
+	uint64_t hash = frame_hash(message);
+	if (session->resuming && message->timestamp <= session->last_timestamp) {
+		if (message->timestamp < session->last_timestamp) {
+			return true;
+		}
+		for (size_t i = 0; i < session->seen_count && i < SEEN_MAX; i++) {
+			if (session->seen[i] == hash) {
+				return true;
+			}
+		}
+	}
+	if (message->timestamp > session->last_timestamp) { // a new second starts a new set
+		session->last_timestamp = message->timestamp;
+		session->seen_count = 0;
+	}
+	if (message->timestamp == session->last_timestamp) {
+		session->seen[session->seen_count % SEEN_MAX] = hash; // a burst beyond SEEN_MAX overwrites the oldest
+		session->seen_count++;
+	}
+	return false;
+}
+
+uint64_t index_key(const char* text, size_t length, char kind) {
+	// FNV-1a of the lowercased text, kind ('u' for usernames, 't' for message tokens) keeps the two apart
+	// keys are 64 bits so collisions are rare enough to not verify matches against the frames
+	uint64_t hash = 14695981039346656037ULL;
+	hash = (hash ^ (unsigned char)kind) * 1099511628211ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char)tolower((unsigned char)text[i])) * 1099511628211ULL;
+	}
+	return hash == 0 ? 1 : hash; // 0 marks empty slots
+}
+
+size_t index_tokenize(const char* text, size_t length, uint64_t* keys, size_t max) {
+	// splits text into runs of letters and digits and stores their token keys
+	// returns the number of keys stored
+	size_t count = 0;
+	size_t i = 0;
+	while (i < length && count < max) {
+		while (i < length && !isalnum((unsigned char)text[i])) {
+			i++;
+		}
+		size_t start = i;
+		while (i < length && isalnum((unsigned char)text[i])) {
+			i++;
+		}
+		if (i > start) {
+			keys[count++] = index_key(text + start, i - start, 't');
+		}
+	}
+	return count;
+}
+
+posting_list_t* index_find(const search_index_t* index, uint64_t key) {
+	// the posting list of key, or the empty slot it would go in
+	size_t slot = key & (index->slot_count - 1);
+	while (index->slots[slot].key != 0 && index->slots[slot].key != key) {
+		slot = (slot + 1) & (index->slot_count - 1);
+	}
+	return &index->slots[slot];
+}
+
+int index_insert(search_index_t* index, uint64_t key, uint32_t frame) {
+	// adds frame to the posting list of key in memory, frames arrive in ascending order
+	// returns 0 on success and -1 if memory ran out
+	if ((index->used + 1) * 10 > index->slot_count * 7) { // keeps the table under 70% full
+		size_t slot_count = index->slot_count ? index->slot_count * 2 : 1024;
+		posting_list_t* slots = calloc(slot_count, sizeof(posting_list_t));
+		if (slots == NULL) {
+			return -1;
+		}
+		search_index_t grown = { .slots = slots, .slot_count = slot_count };
+		for (size_t i = 0; i < index->slot_count; i++) {
+			if (index->slots[i].key != 0) {
+				*index_find(&grown, index->slots[i].key) = index->slots[i];
+			}
+		}
+		free(index->slots);
+		index->slots = slots;
+		index->slot_count = slot_count;
+	}
+
+	posting_list_t* list = index_find(index, key);
+	if (list->key == 0) {
+		list->key = key;
+		index->used++;
+	}
+	if (list->count > 0 && list->frames[list->count - 1] == frame) { // the token repeats within the frame
+		return 0;
+	}
+	if (list->count == list->capacity) {
+		uint32_t capacity = list->capacity ? list->capacity * 2 : 4;
+		uint32_t* frames = realloc(list->frames, capacity * sizeof(uint32_t));
+		if (frames == NULL) {
+			return -1;
+		}
+		list->frames = frames;
+		list->capacity = capacity;
+	}
+	list->frames[list->count++] = frame;
+	return 0;
+}
+
+int index_add(search_index_t* index, uint32_t frame, const message_t* message) {
+	// indexes the username and tokens of a newly cached frame in memory and appends its postings to the file
+	// returns 0 on success and -1 on failure
+	uint64_t keys[INDEX_TOKENS_MAX + 1];
+	keys[0] = index_key(message->username, strnlen(message->username, sizeof(message->username)), 'u');
+	size_t count = 1 + index_tokenize(message->message, strnlen(message->message, sizeof(message->message)), keys + 1, INDEX_TOKENS_MAX);
+
+	posting_t postings[INDEX_TOKENS_MAX + 1];
+	for (size_t i = 0; i < count; i++) {
+		if (index_insert(index, keys[i], frame) == -1) {
+			print_error("Failed to allocate search index");
+			return -1;
+		}
+		postings[i] = (posting_t){ .key = keys[i], .frame = frame };
+	}
+	index->frame_count = (uint64_t)frame + 1;
+
+	// postings first, then the header, so a crash in between only loses this frame (it is indexed again on open)
+	if (perform_full_write(postings, count * sizeof(posting_t), index->fd, NULL) != (ssize_t)(count * sizeof(posting_t))
+			|| pwrite(index->fd, &index->frame_count, sizeof(index->frame_count), offsetof(index_header_t, frame_count)) == -1) {
+		print_error("Failed to write search index");
+		return -1;
+	}
+	return 0;
+}
+
+void index_close(search_index_t* index) {
+	// frees the posting lists and closes the index file
+	for (size_t i = 0; i < index->slot_count; i++) {
+		free(index->slots[i].frames);
+	}
+	free(index->slots);
+	index->slots = NULL;
+	index->slot_count = 0;
+	index->used = 0;
+	if (index->fd != -1) {
+		close(index->fd);
+		index->fd = -1;
+	}
+}
+
+int index_open(search_index_t* index, const cache_t* cache, const char* cache_path) {
+	// loads cache_path.idx into memory and indexes whatever the cache has beyond it
+	// a missing, foreign or inconsistent index file is rebuilt from the cache
+	// returns 0 on success and -1 on failure
+	char path[4096];
+	if (snprintf(path, sizeof(path), "%s.idx", cache_path) >= (int)sizeof(path)) {
+		print_error("Cache path is too long");
+		return -1;
+	}
+	index->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (index->fd == -1) {
+		print_error(strerror(errno));
+		print_error("Failed to open the search index");
+		return -1;
+	}
+
+	struct stat info;
+	index_header_t header = {0};
+	size_t cached = cache_header(cache)->frame_count;
+	bool valid = fstat(index->fd, &info) == 0 && (size_t)info.st_size >= sizeof(header)
+		&& pread(index->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+		&& memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0 && header.version == INDEX_VERSION
+		&& header.posting_size == sizeof(posting_t) && header.frame_count <= cached;
+	size_t posting_count = valid ? ((size_t)info.st_size - sizeof(header)) / sizeof(posting_t) : 0;
+	size_t kept = 0; // postings of fully indexed frames, always a prefix since postings are in frame order
+
+	if (posting_count > 0) {
+		void* map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, index->fd, 0);
+		if (map == MAP_FAILED) {
+			print_error(strerror(errno));
+			index_close(index);
+			return -1;
+		}
+		const posting_t* postings = (const posting_t*)((const char*)map + sizeof(header));
+		while (kept < posting_count && postings[kept].frame < header.frame_count) {
+			if (index_insert(index, postings[kept].key, postings[kept].frame) == -1) {
+				print_error("Failed to allocate search index");
+				munmap(map, (size_t)info.st_size);
+				index_close(index);
+				return -1;
+			}
+			kept++;
+		}
+		munmap(map, (size_t)info.st_size);
+	}
+
+	if (!valid) { // starts over, the whole cache is indexed below
+		memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+		header.version = INDEX_VERSION;
+		header.posting_size = sizeof(posting_t);
+		header.frame_count = 0;
+	}
+	// drops the postings of a frame that was only partly written
+	if (ftruncate(index->fd, (off_t)(sizeof(header) + kept * sizeof(posting_t))) == -1
+			|| pwrite(index->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+		print_error(strerror(errno));
+		index_close(index);
+		return -1;
+	}
+	index->frame_count = header.frame_count;
+	for (size_t i = header.frame_count; i < cached; i++) { // catches up with frames cached without the index
+		if (index_add(index, (uint32_t)i, cache_frame(cache, i)) == -1) {
+			index_close(index);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+size_t search_intersect(uint32_t* matches, size_t count, const posting_list_t* list) {
+	// keeps the matches that are also in list, both ascending
+	// returns the number of matches kept
+	size_t kept = 0;
+	size_t j = 0;
+	for (size_t i = 0; i < count; i++) {
+		while (j < list->count && list->frames[j] < matches[i]) {
+			j++;
+		}
+		if (j < list->count && list->frames[j] == matches[i]) {
+			matches[kept++] = matches[i];
+		}
+	}
+	return kept;
+}
+
+void search_run(const char* query, size_t length, bool from) {
+	// /search term... prints the newest cached messages containing every term
+	// /from user [term...] does the same for the messages of one user
+	static renderer_t output = {0}; // the global renderer belongs to the render thread in threaded mode
+	uint64_t started = monotonic_ns();
+	uint64_t keys[INDEX_TOKENS_MAX + 1];
+	size_t key_count = 0;
+	while (length > 0 && query[0] == ' ') {
+		query++;
+		length--;
+	}
+	size_t skip = 0; // start of the terms after the username of /from
+	if (from) {
+		size_t end = skip;
+		while (end < length && query[end] != ' ') {
+			end++;
+		}
+		if (end > skip) {
+			keys[key_count++] = index_key(query + skip, end - skip, 'u');
+		}
+		skip = end;
+	}
+	key_count += index_tokenize(query + skip, length - skip, keys + key_count, INDEX_TOKENS_MAX);
+	if (key_count == 0) {
+		print_error(from ? "Usage: /from USER [TERM...]" : "Usage: /search TERM...");
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	if (search_index.fd == -1) {
+		pthread_mutex_unlock(&cache_lock);
+		print_error("/search and /from need --cache");
+		return;
+	}
+	// starts from the shortest posting list so the intersection only ever shrinks it
+	static const posting_list_t no_postings = {0}; // an empty cache hasn't grown a table to probe yet
+	const posting_list_t* lists[INDEX_TOKENS_MAX + 1];
+	size_t shortest = 0;
+	for (size_t i = 0; i < key_count; i++) {
+		lists[i] = search_index.slot_count > 0 ? index_find(&search_index, keys[i]) : &no_postings;
+		if (lists[i]->count < lists[shortest]->count) {
+			shortest = i;
+		}
+	}
+	size_t count = lists[shortest]->count;
+	uint32_t* matches = malloc((count ? count : 1) * sizeof(uint32_t));
+	if (matches == NULL) {
+		pthread_mutex_unlock(&cache_lock);
+		print_error("Failed to allocate search results");
+		return;
+	}
+	memcpy(matches, lists[shortest]->frames, count * sizeof(uint32_t));
+	for (size_t i = 0; i < key_count && count > 0; i++) {
+		if (i != shortest) {
+			count = search_intersect(matches, count, lists[i]);
+		}
+	}
+
+	size_t first = count > SEARCH_RESULTS_MAX ? count - SEARCH_RESULTS_MAX : 0;
+	mention_pattern_t mention;
+	mention_init(&mention, settings.username);
+	for (size_t i = first; i < count; i++) {
+		render_message(&output, cache_frame(&cache, matches[i]), settings.quiet ? NULL : &mention);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	free(matches);
+
+	message_t summary = { .message_type = SYSTEM };
+	snprintf(summary.message, sizeof(summary.message), "%zu match(es) for \"%.*s\"%s, %.3f ms", count, (int)length, query,
+		count > SEARCH_RESULTS_MAX ? " (newest 20 shown)" : "", (monotonic_ns() - started) / 1e6);
+	render_message(&output, &summary, NULL);
+	if (render_flush(&output) == -1) {
+		print_error("Failed to write message to stdout");
+	}
+}
+
+bool input_command(const char* input, size_t len) {
+	// runs /search and /from locally instead of sending them, returns false for every other line
+	if (len >= 7 && memcmp(input, "/search", 7) == 0 && (len == 7 || input[7] == ' ')) {
+		search_run(input + 7, len - 7, false);
+		return true;
+	}
+	if (len >= 5 && memcmp(input, "/from", 5) == 0 && (len == 5 || input[5] == ' ')) {
+		search_run(input + 5, len - 5, true);
+		return true;
+	}
+	return false;
+}
+
+void cache_prime(const cache_t* cache, session_t* session) {
+	// treats the first login like a reconnect: the history the server replays up to the newest cached message is skipped
+	size_t count = cache_header(cache)->frame_count;
+	if (count == 0) {
+		return;
+	}
+	for (size_t i = cache_lower_bound(cache, cache_frame(cache, count - 1)->timestamp); i < count; i++) {
+		session_seen(session, cache_frame(cache, i)); // records the newest second of the cache
+	}
+	session->resuming = true;
+}
+
+int handle_frame(session_t* session, const message_t* message) {
+	// handles one inbound frame in host byte order
+	// returns 0 to keep going, 1 if the server disconnected us and -1 on failure
+	// check the message type
+	if (message->message_type == MESSAGE_RECV || message->message_type == SYSTEM) { // displayable message
+		if (!session->render) { // background sessions only drain their socket
+			return 0;
+		}
+		if (message->message_type == SYSTEM) { // the welcome ends the history
+			if (session->resuming) {
+				session->resuming = false;
+				session->reconnect_attempts = 0; // logged in again, the next loss starts the backoff over
+			}
+		} else if ((settings.reconnect || session->resuming) && session_seen(session, message)) { // already shown
+			return 0;
+		}
+		if (message->message_type == MESSAGE_RECV && cache.fd != -1) { // searches may be running on the main thread
+			uint64_t stored = settings.stats ? monotonic_ns() : 0;
+			pthread_mutex_lock(&cache_lock);
+			int appended = cache_append(&cache, message);
+			if (appended == 1 && search_index.fd != -1
+					&& index_add(&search_index, (uint32_t)(cache_header(&cache)->frame_count - 1), message) == -1) {
+				print_error("Search index stopped");
+				index_close(&search_index);
+			}
+			if (appended == -1) {
+				print_error("Failed to grow the message cache, caching stopped");
+				index_close(&search_index);
+				cache_close(&cache);
+			}
+			pthread_mutex_unlock(&cache_lock);
+			if (settings.stats) {
+				session->stats.store_ns += monotonic_ns() - stored;
+			}
+		}
+		if (message->message_type == MESSAGE_RECV && settings.refresh_ms && renderer.backlog > RENDER_BACKLOG_MAX) {
+			renderer.skipped++; // a flood the terminal can't keep up with, only the newest messages are shown
+			session->stats.render_skipped++;
+			return 0;
+		}
+		render_skipped(&renderer);
+		uint64_t started = settings.stats ? monotonic_ns() : 0; // only pays for the clock when it is reported
+		int mentions = render_message(&renderer, message, session->quiet ? NULL : &session->mention);
+		if (mentions == -1) {
+			print_error("Failed to write message to stdout");
+			return -1;
+		}
+		if (settings.stats) {
+			session->stats.render_ns += monotonic_ns() - started;
+		}
+		session->stats.rendered++;
+		session->stats.mentions += mentions;
+		return 0;
+	} else if (message->message_type == DISCONNECT) { // checks if the message from the server is DISCONNECT type
+		render_message(&renderer, message, NULL); // prints the disconnect message to stdout
+		session->logged_out = true; // the server closes the socket, nothing more may be sent
+		if (settings.event_loop) { // the other sessions and reconnects keep to the limit the server stated
+			send_learn(message->message);
+		}
+		return 1;
+	}
+	// invalid inbound message
+	render_flush(&renderer); // shows what was received before the bad frame
+	print_error("Invalid inbound message from server");
+	return -1;
+}
+
+int bench_start(engine_t* engine) {
+	// schedules the first bench message of every session, spread evenly over one interval
+	// returns 0 on success and -1 on failure
+	bench.interval_ns = (uint64_t)(1e9 / settings.bench_rate);
+	bench.start_ns = monotonic_ns();
+	bench.stop_ns = bench.start_ns + (uint64_t)(settings.bench_duration * 1e9);
+	bench.latency_capacity = 1024;
+	bench.latencies = malloc(bench.latency_capacity * sizeof(uint64_t));
+	if (bench.latencies == NULL) { // checks if malloc failed
+		print_error("Failed to allocate bench results");
+		return -1;
+	}
+	for (size_t i = 0; i < engine->session_count; i++) {
+		engine->sessions[i]->next_send_ns = bench.start_ns + bench.interval_ns * i / engine->session_count;
+	}
+	return 0;
+}
+
+uint64_t bench_tick(engine_t* engine) {
+	// sends every bench message that is due and stops the client once the grace period is over
+	// returns the monotonic time of the next thing to do
+	uint64_t now = monotonic_ns();
+	if (now >= bench.stop_ns + BENCH_GRACE_NS) { // every outstanding echo had its chance to arrive
+		settings.running = false;
+		return now;
+	}
+	if (now >= bench.stop_ns) { // done sending, waiting for echoes
+		return bench.stop_ns + BENCH_GRACE_NS;
+	}
+
+	uint64_t next = bench.stop_ns;
+	for (size_t i = 0; i < engine->session_count; i++) {
+		session_t* session = engine->sessions[i];
+		if (session->logged_out || session->socket_fd == -1) {
+			continue;
+		}
+		if (session->next_send_ns <= now) {
+			char payload[64];
+			int length = snprintf(payload, sizeof(payload), BENCH_PREFIX "%u %llu", session->sequence++, (unsigned long long)monotonic_ns());
+			if (send_message(session, MESSAGE_SEND, NULL, payload, (size_t)length) == -1) {
+				print_error("Failed to write to server");
+				settings.running = false;
+				return now;
+			}
+			bench.sent++;
+			// a late wakeup never shortens the gap to the next message, so the session stays under the rate limit
+			session->next_send_ns = now + bench.interval_ns;
+		}
+		if (session->next_send_ns < next) {
+			next = session->next_send_ns;
+		}
+	}
+	return next;
+}
+
+void bench_observe(session_t* session, const message_t* message) {
+	// counts every frame and records the round trip of a session's own bench messages when they come back
+	bench.frames_received++;
+	if (message->message_type != MESSAGE_RECV || strncmp(message->username, session->username, sizeof(message->username)) != 0
+			|| strncmp(message->message, BENCH_PREFIX, strlen(BENCH_PREFIX)) != 0) {
+		return;
+	}
+	unsigned int sequence;
+	unsigned long long sent_ns;
+	if (sscanf(message->message + strlen(BENCH_PREFIX), "%u %llu", &sequence, &sent_ns) != 2) {
+		return;
+	}
+	if (bench.latency_count == bench.latency_capacity) { // grows the results array
+		uint64_t* latencies = realloc(bench.latencies, bench.latency_capacity * 2 * sizeof(uint64_t));
+		if (latencies == NULL) { // keeps the results collected so far
+			return;
+		}
+		bench.latencies = latencies;
+		bench.latency_capacity *= 2;
+	}
+	bench.latencies[bench.latency_count++] = monotonic_ns() - (uint64_t)sent_ns;
+}
+
+int compare_u64(const void* a, const void* b) {
+	// qsort comparison for uint64_t values
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+double percentile_ms(const uint64_t* sorted, size_t count, double fraction) {
+	// nearest rank percentile of sorted nanosecond values, in milliseconds
+	if (count == 0) {
+		return 0;
+	}
+	size_t rank = (size_t)(fraction * count + 0.999999999);
+	if (rank < 1) {
+		rank = 1;
+	}
+	return sorted[rank - 1] / 1e6;
+}
+
+void bench_report(const engine_t* engine) {
+	// prints the bench results to stdout and frees them
+	double connect_total = 0, connect_max = 0, login_total = 0, login_max = 0;
+	size_t logged_in = 0;
+	for (size_t i = 0; i < engine->session_count; i++) {
+		const session_t* session = engine->sessions[i];
+		double connect_ms = (session->connected_ns - session->connect_started_ns) / 1e6;
+		connect_total += connect_ms;
+		connect_max = connect_ms > connect_max ? connect_ms : connect_max;
+		if (session->first_frame_ns != 0) { // the server answered the LOGIN
+			double login_ms = (session->first_frame_ns - session->login_sent_ns) / 1e6;
+			login_total += login_ms;
+			login_max = login_ms > login_max ? login_ms : login_max;
+			logged_in++;
+		}
+	}
+
+	qsort(bench.latencies, bench.latency_count, sizeof(uint64_t), compare_u64);
+	double seconds = (bench.stop_ns - bench.start_ns) / 1e9;
+	printf("sessions:     %zu (%zu logged in)\n", engine->session_count, logged_in);
+	printf("connect:      avg %.3f ms, max %.3f ms\n", connect_total / engine->session_count, connect_max);
+	printf("login:        avg %.3f ms, max %.3f ms\n", logged_in ? login_total / logged_in : 0, login_max);
+	printf("sent:         %llu messages (%.1f msgs/sec)\n", (unsigned long long)bench.sent, bench.sent / seconds);
+	printf("echoed:       %zu messages (%llu lost)\n", bench.latency_count,
+		(unsigned long long)(bench.sent > bench.latency_count ? bench.sent - bench.latency_count : 0));
+	printf("received:     %llu frames (%.1f frames/sec)\n", (unsigned long long)bench.frames_received, bench.frames_received / seconds);
+	printf("latency:      p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+		percentile_ms(bench.latencies, bench.latency_count, 0.50),
+		percentile_ms(bench.latencies, bench.latency_count, 0.99),
+		percentile_ms(bench.latencies, bench.latency_count, 0.999),
+		percentile_ms(bench.latencies, bench.latency_count, 1.0));
+	fflush(stdout);
+	free(bench.latencies);
+	bench.latencies = NULL;
+}
+
+int queue_frame(session_t* session, uint32_t slot) {
+	// hands the frame in a pool slot to the render thread so a slow stdout never holds up reading the socket
+	// the queue gets its own reference, the caller still owns (and releases) the one it had
+	// chat frames are dropped (and counted) if the render thread is a whole queue behind,
+	// DISCONNECT and invalid frames end the session so they wait for room instead, as does everything in a replay
+	// returns 0 to keep going, 1 if the server disconnected us and -1 for an invalid frame
+	const message_t* message = &frame_pool.slots[slot];
+	bool ends_session = message->message_type != MESSAGE_RECV && message->message_type != SYSTEM;
+	frame_pool_ref(&frame_pool, slot);
+	while (!frame_queue_push(session->queue, slot)) {
+		if (!(ends_session || settings.replay_path != NULL) || atomic_load(&session->queue->consumer_done)) {
+			atomic_fetch_add(&session->queue->dropped, 1);
+			session->stats.frames_dropped++;
+			frame_pool_release(&frame_pool, slot);
+			break;
+		}
+		uint64_t waited = settings.stats ? monotonic_ns() : 0;
+		struct timespec pause = { .tv_nsec = settings.replay_path != NULL ? 50000 : 1000000 }; // a replay must not leave the render thread idle
+		nanosleep(&pause, NULL);
+		session->stats.queue_waits++;
+		if (settings.stats) {
+			session->stats.queue_wait_ns += monotonic_ns() - waited;
+		}
+	}
+	if (message->message_type == DISCONNECT) { // nothing more may be sent, main checks this before LOGOUT
+		session->logged_out = true;
+		return 1;
+	}
+	return ends_session ? -1 : 0; // the render thread reports the invalid frame
+}
+
+bool capability_listed(const char* list, const char* name) {
+	// checks whether the space separated capability list of a LOGIN_ACK contains name
+	size_t length = strlen(name);
+	for (const char* found = strstr(list, name); found != NULL; found = strstr(found + 1, name)) {
+		if ((found == list || found[-1] == ' ') && (found[length] == ' ' || found[length] == '\0')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int receive_dispatch(session_t* session, message_t* message, uint32_t slot) {
+	// handles one complete frame from the socket, inline or (when it is in a frame pool slot) queued for the render thread
+	// returns 0 to keep going, 1 once the server ended the session and -1 for an invalid frame
+	session->stats.frames_read++;
+	if (message->message_type == SYSTEM && session->history_done_ns == 0) { // the welcome follows the history
+		session->history_done_ns = monotonic_ns();
+	}
+	if (settings.bench) {
+		bench_observe(session, message);
+	}
+	if (message->message_type == LOGIN_ACK) { // the capabilities from LOGIN the server accepted
+		if (session->compact_requested && capability_listed(message->message, CAPABILITY_COMPACT)) {
+			session->compact = true; // everything after the ack is compact
+		}
+		if (settings.keepalive_interval && capability_listed(message->message, CAPABILITY_KEEPALIVE)) {
+			session->keepalive = true;
+			keepalive_schedule(session, true);
+		}
+		return 0;
+	}
+	return slot != FRAME_POOL_NONE ? queue_frame(session, slot) : handle_frame(session, message);
+}
+
+int receive_ended(session_t* session) {
+	// the read failed or the server closed the connection
+	// returns 1 if the session was ending anyway and -1 otherwise
+	if (session->logged_out || !settings.running) { // checks to see if we are shutting down
+		return 1;
+	}
+	print_error("Failed to read message from server");
+	return -1;
+}
+
+uint32_t receive_slot(session_t* session) {
+	// takes a free frame pool slot for the receive thread, waiting for the render thread to release one if needed
+	uint32_t slot;
+	while ((slot = frame_pool_acquire(&frame_pool)) == FRAME_POOL_NONE) {
+		session->stats.pool_waits++;
+		struct timespec pause = { .tv_nsec = 1000000 }; // waits a millisecond for the render thread
+		nanosleep(&pause, NULL);
+	}
+	return slot;
+}
+
+size_t receive_backlog(const receive_buffer_t* receive, int socket_fd) {
+	// estimates the frames received but not handled yet: the complete ones in the buffer plus
+	// what the socket still holds at the average frame size of the buffer
+	size_t frames = 0;
+	size_t offset = receive->start;
+	while (offset < receive->end) {
+		size_t length = sizeof(message_t);
+		if ((uint8_t)receive->data[offset] & COMPACT_FLAG) { // compact frame
+			compact_header_t header;
+			if (receive->end - offset < sizeof(header)) {
+				break;
+			}
+			memcpy(&header, receive->data + offset, sizeof(header));
+			length = sizeof(header) + header.username_length + ntohs(header.message_length);
+		}
+		if (receive->end - offset < length) { // partial frame
+			break;
+		}
+		offset += length;
+		frames++;
+	}
+	int queued = 0;
+	if (frames > 0 && ioctl(socket_fd, FIONREAD, &queued) == 0 && queued > 0) {
+		frames += (size_t)queued * frames / (offset - receive->start);
+	}
+	return frames;
+}
+
+int receive_buffered(session_t* session) {
+	// handles every complete frame in the receive buffer, in threaded mode compact frames are expanded
+	// straight into the pool slot they are queued in
+	// returns 0 to keep going, 1 once the server ended the session and -1 for an invalid frame
+	int result = 0;
+	size_t backlog = 0; // the render thread keeps track of it in threaded mode
+	if (settings.refresh_ms && session->render && session->queue == NULL) {
+		backlog = receive_backlog(&session->receive, session->socket_fd);
+	}
+	while (result == 0) {
+		uint32_t slot = FRAME_POOL_NONE;
+		message_t* decoded = &session->receive.decoded;
+		if (session->queue != NULL) {
+			slot = receive_slot(session);
+			decoded = &frame_pool.slots[slot];
+		}
+		message_t* message = receive_next_frame(&session->receive, decoded);
+		if (message != NULL && slot != FRAME_POOL_NONE && message != decoded) { // a fixed size frame has to move into the slot
+			*decoded = *message;
+			message = decoded;
+		}
+		if (message != NULL) {
+			if (backlog > 0) {
+				renderer.backlog = --backlog;
+			}
+			result = receive_dispatch(session, message, slot);
+		}
+		if (slot != FRAME_POOL_NONE) {
+			frame_pool_release(&frame_pool, slot);
+		}
+		if (message == NULL) { // nothing complete is left
+			break;
+		}
+	}
+	if (result == 0 && session->receive.start != session->receive.end) { // the read stopped in the middle of a frame
+		session->stats.short_reads++;
+	}
+	return result;
+}
+
+int session_receive_slots(session_t* session) {
+	// threaded mode with fixed size framing: reads the socket with one readv straight into frame pool slots,
+	// so every frame is rendered, cached and indexed from the slot it was read into without being copied
+	// returns 0 to keep going, 1 once the server ended the session and -1 on failure
+	frame_reader_t* reader = &session->reader;
+	struct iovec iov[FRAME_READ_BATCH + 1];
+	uint32_t slots[FRAME_READ_BATCH + 1];
+	size_t count = 0;
+	if (reader->partial != FRAME_POOL_NONE) { // the rest of the frame the last read stopped in comes first
+		slots[0] = reader->partial;
+		iov[0].iov_base = (char*)&frame_pool.slots[reader->partial] + reader->filled;
+		iov[0].iov_len = sizeof(message_t) - reader->filled;
+		count = 1;
+	}
+	for (size_t batch = count + FRAME_READ_BATCH; count < batch; count++) {
+		slots[count] = receive_slot(session);
+		iov[count].iov_base = &frame_pool.slots[slots[count]];
+		iov[count].iov_len = sizeof(message_t);
+	}
+
+	ssize_t size;
+	while (true) {
+		size = readv(session->socket_fd, iov, (int)count); // read from socket
+		session->stats.read_calls++;
+		if (size == -1 && errno == EINTR) { // signal interrupt
+			session->stats.read_retries++;
+			continue;
+		}
+		break;
+	}
+	if (size == -1) { // checks if read failed
+		print_error(strerror(errno));
+	}
+	if (size <= 0) { // checks for a failed read or a closed connection
+		for (size_t i = 0; i < count; i++) {
+			frame_pool_release(&frame_pool, slots[i]);
+		}
+		reader->partial = FRAME_POOL_NONE;
+		return receive_ended(session);
+	}
+	session->stats.bytes_read += size;
+	if (session->first_frame_ns == 0) { // the server answered the LOGIN
+		session->first_frame_ns = monotonic_ns();
+	}
+
+	size_t remaining = size;
+	size_t i = 0;
+	int result = 0;
+	reader->partial = FRAME_POOL_NONE;
+	for (; i < count && remaining > 0 && result == 0; i++) {
+		if (session->compact) { // the LOGIN_ACK switched to compact framing, the rest of the read goes to the receive buffer
+			size_t length = remaining < iov[i].iov_len ? remaining : iov[i].iov_len;
+			memcpy(session->receive.data + session->receive.end, iov[i].iov_base, length);
+			session->receive.end += length;
+			remaining -= length;
+		} else if (remaining < iov[i].iov_len) { // the read stopped in the middle of a frame, the slot is kept for the next read
+			reader->partial = slots[i];
+			reader->filled = sizeof(message_t) - iov[i].iov_len + remaining;
+			remaining = 0;
+			session->stats.short_reads++;
+			continue;
+		} else {
+			remaining -= iov[i].iov_len;
+			message_t* message = &frame_pool.slots[slots[i]];
+			// convert from network to host byte order
+			message->message_type = ntohl(message->message_type);
+			message->timestamp = ntohl(message->timestamp);
+			result = receive_dispatch(session, message, slots[i]);
+		}
+		frame_pool_release(&frame_pool, slots[i]);
+	}
+	for (; i < count; i++) { // slots the read did not reach
+		frame_pool_release(&frame_pool, slots[i]);
+	}
+	if (result == 0 && session->receive.end > 0) { // compact frames that came in the same read as the LOGIN_ACK
+		result = receive_buffered(session);
+	}
+	return result;
+}
+
+int session_receive(session_t* session) {
+	// reads every frame the socket has buffered with a single read and handles them
+	// output is left in the renderer so the caller can flush once per batch
+	// returns 0 to keep going, 1 once the server ended the session and -1 on failure
+	if (session->queue != NULL && !session->compact) {
+		return session_receive_slots(session);
+	}
+	ssize_t size = receive_fill(&session->receive, session->socket_fd, &session->stats);
+
+	if (size <= 0) { // checks for a failed read or a closed connection
+		return receive_ended(session);
+	}
+
+	if (session->first_frame_ns == 0) { // the server answered the LOGIN
+		session->first_frame_ns = monotonic_ns();
+	}
+	return receive_buffered(session);
+}
+
+int session_receive_bytes(session_t* session, const char* data, size_t length) {
+	// --io-uring: handles the bytes a multishot recv completed with like session_receive handles a read
+	// returns 0 to keep going, 1 once the server ended the session and -1 on failure
+	receive_buffer_t* receive = &session->receive;
+	if (receive->start > 0) { // moves the partial frame left over from the last completion to the front
+		memmove(receive->data, receive->data + receive->start, receive->end - receive->start);
+		receive->end -= receive->start;
+		receive->start = 0;
+	}
+	if (length > RECEIVE_BUFFER_SIZE - receive->end) { // only a partial frame is ever left over, so this can't happen
+		print_error("Receive buffer overflow");
+		return -1;
+	}
+	memcpy(receive->data + receive->end, data, length);
+	receive->end += length;
+	session->stats.bytes_read += length;
+	if (session->first_frame_ns == 0) { // the server answered the LOGIN
+		session->first_frame_ns = monotonic_ns();
+	}
+	return receive_buffered(session);
+}
+
+void* receive_messages_thread(void* arg) {
+	// worker thread to receive messages from the server and queue them for the render thread
+	// while some condition(s) are true
+	session_t* session = (session_t*) arg; // casts the session from the argument
+	if (session == NULL || session->queue == NULL) { // checks if arg is null
+	       print_error("Failed to pass session to worker");
+	       pthread_exit((void*)1);
+    	}	       
+
+	int result = 0;
+	while (settings.running && result == 0) { // does work as long as the client is connected to the server
+		uint64_t started = settings.stats ? monotonic_ns() : 0; // includes waiting for the socket unless replaying
+		result = session_receive(session);
+		if (settings.stats) {
+			session->stats.receive_ns += monotonic_ns() - started;
+		}
+	}
+	if (result == 1) { // disconnected by the server
+		settings.running = false; // stops reading
+	}
+	frame_queue_close(session->queue); // lets the render thread finish what is queued
+	return result == -1 ? (void*)1 : NULL; 
+}
+
+void render_dropped(frame_queue_t* queue) {
+	// tells the user how many chat messages were dropped since the last notice
+	size_t dropped = atomic_exchange(&queue->dropped, 0);
+	if (dropped == 0) {
+		return;
+	}
+	message_t notice = { .message_type = SYSTEM };
+	snprintf(notice.message, sizeof(notice.message), "%zu message(s) dropped, output could not keep up", dropped);
+	render_message(&renderer, &notice, NULL);
+}
+
+void* render_messages_thread(void* arg) {
+	// worker thread that formats queued frames and writes them to stdout
+	// flushes whenever it has caught up with the receive thread, so a burst becomes one write
+	session_t* session = (session_t*) arg; // casts the session from the argument
+	frame_queue_t* queue = session->queue;
+	int result = 0;
+
+	while (result == 0) {
+		uint64_t deadline = render_deadline(&renderer); // --refresh-ms output waiting for its interval
+		struct timespec until = { .tv_sec = deadline / 1000000000ULL, .tv_nsec = deadline % 1000000000ULL };
+		bool flush = false;
+		if ((deadline ? sem_clockwait(&queue->ready, CLOCK_MONOTONIC, &until) : sem_wait(&queue->ready)) == -1) { // sleeps until a frame is pushed or the queue closes
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != ETIMEDOUT) {
+				print_error(strerror(errno));
+				result = -1;
+				break;
+			}
+			flush = true; // the interval is over, writes what it held back
+		} else {
+			uint32_t slot = frame_queue_peek(queue);
+			if (slot == FRAME_POOL_NONE) { // closed and fully drained
+				break;
+			}
+			frame_queue_pop(queue); // the frame stays in its pool slot, the queue entry can go right away
+			render_dropped(queue);
+			if (settings.refresh_ms) {
+				renderer.backlog = frame_queue_depth(queue);
+			}
+			result = handle_frame(session, &frame_pool.slots[slot]);
+			frame_pool_release(&frame_pool, slot);
+			flush = settings.refresh_ms ? render_due(&renderer) : frame_queue_peek(queue) == FRAME_POOL_NONE;
+		}
+
+		if (flush) { // caught up or (with --refresh-ms) the interval is over, one write for the batch
+			uint64_t started = settings.stats ? monotonic_ns() : 0;
+			if (render_flush(&renderer) == -1 && result == 0) {
+				print_error("Failed to write message to stdout");
+				result = -1;
+			}
+			if (settings.stats) {
+				session->stats.flush_ns += monotonic_ns() - started;
+			}
+		}
+	}
+	render_flush(&renderer);
+	atomic_store(&queue->consumer_done, true); // the receive thread must not wait for room anymore
+	return result == -1 ? (void*)1 : NULL;
+}
+
+void stats_total(const engine_t* engine, stats_t* total) {
+	// adds up the counters of every session
+	memset(total, 0, sizeof(*total));
+	for (size_t i = 0; i < engine->session_count; i++) {
+		const stats_t* stats = &engine->sessions[i]->stats;
+		total->read_calls += stats->read_calls;
+		total->bytes_read += stats->bytes_read;
+		total->frames_read += stats->frames_read;
+		total->short_reads += stats->short_reads;
+		total->read_retries += stats->read_retries;
+		total->write_calls += stats->write_calls;
+		total->bytes_written += stats->bytes_written;
+		total->frames_written += stats->frames_written;
+		total->keepalives += stats->keepalives;
+		total->short_writes += stats->short_writes;
+		total->write_retries += stats->write_retries;
+		total->frames_dropped += stats->frames_dropped;
+		total->render_skipped += stats->render_skipped;
+		total->pool_waits += stats->pool_waits;
+		total->send_queued += stats->send_queued;
+		total->send_queue_max = stats->send_queue_max > total->send_queue_max ? stats->send_queue_max : total->send_queue_max;
+		total->sends_paced += stats->sends_paced;
+		total->rendered += stats->rendered;
+		total->render_ns += stats->render_ns;
+		total->receive_ns += stats->receive_ns;
+		total->queue_wait_ns += stats->queue_wait_ns;
+		total->queue_waits += stats->queue_waits;
+		total->store_ns += stats->store_ns;
+		total->flush_ns += stats->flush_ns;
+		total->mentions += stats->mentions;
+	}
+}
+
+void stats_login_times(const engine_t* engine, double* connect_ms, double* login_ms, double* history_ms) {
+	// averages how long the sessions took to connect, for the first frame after LOGIN and for the end of the history
+	// sessions that haven't got that far yet are left out, an average without any session is 0
+	double totals[3] = {0};
+	size_t counts[3] = {0};
+	for (size_t i = 0; i < engine->session_count; i++) {
+		const session_t* session = engine->sessions[i];
+		if (session->connected_ns != 0) {
+			totals[0] += (session->connected_ns - session->connect_started_ns) / 1e6;
+			counts[0]++;
+		}
+		if (session->first_frame_ns != 0 && session->login_sent_ns != 0) {
+			totals[1] += (session->first_frame_ns - session->login_sent_ns) / 1e6;
+			counts[1]++;
+		}
+		if (session->history_done_ns != 0 && session->login_sent_ns != 0) {
+			totals[2] += (session->history_done_ns - session->login_sent_ns) / 1e6;
+			counts[2]++;
+		}
+	}
+	*connect_ms = counts[0] ? totals[0] / counts[0] : 0;
+	*login_ms = counts[1] ? totals[1] / counts[1] : 0;
+	*history_ms = counts[2] ? totals[2] / counts[2] : 0;
+}
+
+void stats_print(const engine_t* engine, bool machine) {
+	// prints the counters of every session added up to stderr
+	// machine prints one key=value line for scripts, otherwise a summary for people
+	stats_t total;
+	stats_total(engine, &total);
+	double uptime = (monotonic_ns() - start_ns) / 1e9;
+	double connect_ms, login_ms, history_ms;
+	stats_login_times(engine, &connect_ms, &login_ms, &history_ms);
+
+	if (machine) {
+		fprintf(stderr, "stats time=%lld uptime=%.3f sessions=%zu read_calls=%llu bytes_read=%llu frames_read=%llu"
+			" short_reads=%llu read_retries=%llu write_calls=%llu bytes_written=%llu frames_written=%llu"
+			" short_writes=%llu write_retries=%llu keepalives=%llu frames_dropped=%llu rendered=%llu render_ns=%llu mentions=%llu"
+			" connect_ms=%.3f login_ms=%.3f history_ms=%.3f send_queue=%llu send_queue_max=%llu sends_paced=%llu"
+			" send_rate=%.3f send_burst=%u pool_waits=%llu receive_ns=%llu queue_waits=%llu queue_wait_ns=%llu"
+			" store_ns=%llu flush_ns=%llu render_skipped=%llu uring_enters=%llu uring_completions=%llu\n",
+			(long long)time(NULL), uptime, engine->session_count,
+			(unsigned long long)total.read_calls, (unsigned long long)total.bytes_read,
+			(unsigned long long)total.frames_read, (unsigned long long)total.short_reads,
+			(unsigned long long)total.read_retries, (unsigned long long)total.write_calls,
+			(unsigned long long)total.bytes_written, (unsigned long long)total.frames_written,
+			(unsigned long long)total.short_writes, (unsigned long long)total.write_retries,
+			(unsigned long long)total.keepalives, (unsigned long long)total.frames_dropped, (unsigned long long)total.rendered, (unsigned long long)total.render_ns,
+			(unsigned long long)total.mentions, connect_ms, login_ms, history_ms,
+			(unsigned long long)total.send_queued, (unsigned long long)total.send_queue_max,
+			(unsigned long long)total.sends_paced, settings.send_rate, settings.send_burst,
+			(unsigned long long)total.pool_waits, (unsigned long long)total.receive_ns,
+			(unsigned long long)total.queue_waits, (unsigned long long)total.queue_wait_ns,
+			(unsigned long long)total.store_ns, (unsigned long long)total.flush_ns,
+			(unsigned long long)total.render_skipped, (unsigned long long)uring.enters,
+			(unsigned long long)uring.completions);
+		return;
+	}
+	fprintf(stderr, "stats: %zu session(s), %.3f s uptime\n", engine->session_count, uptime);
+	fprintf(stderr, "  login:  %.3f ms connect, %.3f ms LOGIN to first frame, %.3f ms LOGIN to end of history\n",
+		connect_ms, login_ms, history_ms);
+	fprintf(stderr, "  read:   %llu calls, %llu bytes, %llu frames, %llu short reads, %llu EINTR retries\n",
+		(unsigned long long)total.read_calls, (unsigned long long)total.bytes_read,
+		(unsigned long long)total.frames_read, (unsigned long long)total.short_reads,
+		(unsigned long long)total.read_retries);
+	fprintf(stderr, "  write:  %llu calls, %llu bytes, %llu frames, %llu short writes, %llu EINTR retries, %llu keepalives\n",
+		(unsigned long long)total.write_calls, (unsigned long long)total.bytes_written,
+		(unsigned long long)total.frames_written, (unsigned long long)total.short_writes,
+		(unsigned long long)total.write_retries, (unsigned long long)total.keepalives);
+	if (uring.enters > 0) { // socket reads and writes went through io_uring instead
+		fprintf(stderr, "  uring:  %llu io_uring_enter calls, %llu completions\n", (unsigned long long)uring.enters,
+			(unsigned long long)uring.completions);
+	}
+	fprintf(stderr, "  pacing: %llu queued now, %llu at most, %llu lines paced, %.3g per second with bursts of %u\n",
+		(unsigned long long)total.send_queued, (unsigned long long)total.send_queue_max,
+		(unsigned long long)total.sends_paced, settings.send_rate, settings.send_burst);
+	fprintf(stderr, "  render: %llu messages, %.3f us average, %llu mentions, %llu dropped, %llu skipped, %llu waits for a frame slot\n",
+		(unsigned long long)total.rendered, total.rendered ? total.render_ns / 1e3 / total.rendered : 0,
+		(unsigned long long)total.mentions, (unsigned long long)total.frames_dropped,
+		(unsigned long long)total.render_skipped, (unsigned long long)total.pool_waits);
+}
+
+void stats_poll(const engine_t* engine) {
+	// prints whatever SIGUSR1 or the --stats-interval timer asked for since the last call
+	if (atomic_exchange(&stats_requested, false) && settings.stats) {
+		stats_print(engine, false);
+	}
+	if (atomic_exchange(&stats_line_due, false) && settings.stats_interval > 0) {
+		stats_print(engine, true);
+	}
+}
+
+size_t find_unprintable(const char* input, size_t len) {
+	// returns the index of the first byte outside printable ASCII (0x20 to 0x7e, which is isprint in the C locale)
+	// or len if there is none, newlines count as unprintable
+	size_t i = 0;
+#ifdef __SSE2__
+	// 16 bytes per step: bytes are compared as signed, so everything from 0x80 up is negative and fails the > 0x1f test
+	const __m128i low = _mm_set1_epi8(0x1f);
+	const __m128i high = _mm_set1_epi8(0x7f);
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*)(input + i));
+		__m128i printable = _mm_and_si128(_mm_cmpgt_epi8(chunk, low), _mm_cmplt_epi8(chunk, high));
+		int mask = _mm_movemask_epi8(printable) ^ 0xffff; // bits set for unprintable bytes
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	for (; i < len; i++) { // the tail, or everything without SSE2
+		unsigned char c = (unsigned char)input[i];
+		if (c < 0x20 || c > 0x7e) {
+			return i;
+		}
+	}
+	return len;
+}
+
+bool validate_message(const char* input, size_t len) {
+	// checks that a line from stdin can be sent without the server disconnecting us
+	// prints the reason to stderr and returns false if it can't
+	if (len < 1 || len > 1023) { // checks for invalid size
+		print_error("Message must be between 1 amnd 1023 characters");
+		return false;
+	}
+
+	size_t bad = find_unprintable(input, len); // scans the whole line for the first character the server would reject
+	if (bad == len) {
+		return true;
+	}
+	if (input[bad] == '\n') { // checks for a new line character in the middle of the input
+		print_error("Message cannot contain newlines");
+	} else {
+		print_error("Message must contain printable characters only");
+	}
+	return false;
+}
+
+int send_input_line(session_t* session, const char* input, size_t len) {
+	// validates a line from stdin (without its newline) and queues it as MESSAGE_SEND, sending what the rate limit allows
+	// /search and /from run locally, invalid lines are skipped
+	// returns 0 on success, 1 if the send queue is full (the line is left to the caller) and -1 if writing to the server failed
+	if (input_command(input, len)) {
+		return 0;
+	}
+	if (!validate_message(input, len)) { // checks if the message wasn't valid
+		return 0; // skips the invalid message
+	}
+	if (send_queue_push(session, input, len) == 1) {
+		return 1;
+	}
+	return send_queue_release(session);
+}
+
+int send_queue_wait(session_t* session, const engine_t* engine) {
+	// threaded mode: sleeps until every queued line of the session went out, so stdin isn't read ahead of the rate limit
+	// signals in between print stats, returns -1 if writing to the server failed or the client is shutting down
+	while (session->send_queue.count > 0) {
+		if (!settings.running) {
+			return -1;
+		}
+		uint64_t wake = send_queue_due(&session->send_queue);
+		struct timespec until = { .tv_sec = wake / 1000000000ULL, .tv_nsec = wake % 1000000000ULL };
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+			stats_poll(engine);
+		}
+		if (send_queue_release(session) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+uint64_t engine_send_due(engine_t* engine) {
+	// event loop: sends the queued lines whose tokens have come in
+	// returns the monotonic time the next queued line is due, 0 if nothing is queued
+	uint64_t next = 0;
+	for (size_t i = 0; i < engine->session_count; i++) {
+		session_t* session = engine->sessions[i];
+		if (send_queue_release(session) == -1) {
+			print_error("Failed to write to server");
+			settings.running = false;
+			return 0;
+		}
+		if (!session->logged_out && session->socket_fd != -1) { // a lost session's lines wait for the reconnect
+			next = earliest_deadline(next, send_queue_due(&session->send_queue));
+		}
+	}
+	return next;
+}
+
+size_t engine_send_pending(const engine_t* engine) {
+	// number of lines still waiting in the send queues
+	size_t pending = 0;
+	for (size_t i = 0; i < engine->session_count; i++) {
+		pending += engine->sessions[i]->send_queue.count;
+	}
+	return pending;
+}
+
+int engine_send_line(engine_t* engine, const char* input, size_t len) {
+	// queues a stdin line on the next session (round robin) that is still logged in
+	// lines are dropped once every session is gone
+	// returns 1 if that session's queue is full, -1 if writing to the server failed and 0 otherwise
+	for (size_t tried = 0; tried < engine->session_count; tried++) {
+		session_t* session = engine->sessions[engine->next_sender];
+		engine->next_sender = (engine->next_sender + 1) % engine->session_count;
+		if (!session->logged_out && session->socket_fd != -1) {
+			return send_input_line(session, input, len);
+		}
+	}
+	return 0;
+}
+
+int batch_wait(send_queue_t* queue, const engine_t* engine, size_t wanted) {
+	// sleeps until the session's token bucket lets wanted more messages out at once (at most the burst)
+	// signals in between print stats, returns 1 if it had to sleep, 0 if not and -1 if the client is shutting down
+	if (wanted > settings.send_burst) { // the bucket never holds more than the burst
+		wanted = settings.send_burst;
+	}
+	int slept = 0;
+	while (true) {
+		send_refill(queue, monotonic_ns());
+		if (!settings.running) {
+			return -1;
+		}
+		if (queue->tokens >= wanted) {
+			return slept;
+		}
+		slept = 1;
+		uint64_t wake = queue->refilled_ns + (uint64_t)((wanted - queue->tokens) / settings.send_rate * 1e9) + 1;
+		struct timespec until = { .tv_sec = wake / 1000000000ULL, .tv_nsec = wake % 1000000000ULL };
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+			stats_poll(engine);
+		}
+	}
+}
+
+int batch_flush(batch_t* batch, const engine_t* engine) {
+	// sends the waiting lines from the first session in as few writes as the rate limit allows
+	// waits for a whole write's worth of tokens rather than trickling out one frame per token
+	// returns -1 if writing to the server failed or the client is shutting down
+	session_t* session = engine->sessions[0];
+	size_t sent = 0;
+	while (sent < batch->count) {
+		int slept = batch_wait(&session->send_queue, engine, batch->count - sent);
+		if (slept == -1) {
+			return -1;
+		}
+		size_t allowed = (size_t)session->send_queue.tokens;
+		size_t count = batch->count - sent < allowed ? batch->count - sent : allowed;
+		if (send_messages(session, batch->lines + sent, batch->lengths + sent, count) == -1) {
+			return -1;
+		}
+		session->send_queue.tokens -= count;
+		if (slept) {
+			session->stats.sends_paced += count;
+		}
+		sent += count;
+	}
+	batch->count = 0;
+	return 0;
+}
+
+int input_consume_batch(input_buffer_t* input, batch_t* batch, const engine_t* engine, bool eof) {
+	// validates every complete line in the input buffer and sends them coalesced and paced
+	// keeps the partial line at the end (sent at eof), returns -1 if the lines could not be sent
+	size_t start = 0; // start of the current line
+
+	while (start < input->length) {
+		char* newline = memchr(input->data + start, '\n', input->length - start);
+		if (newline == NULL && !eof) { // the rest of the line hasn't arrived yet
+			break;
+		}
+		size_t end = newline == NULL ? input->length : (size_t)(newline - input->data);
+		if (!input->discarding && !input_command(input->data + start, end - start) && validate_message(input->data + start, end - start)) {
+			batch->lines[batch->count] = input->data + start;
+			batch->lengths[batch->count] = end - start;
+			if (++batch->count == RATE_LIMIT_MESSAGES && batch_flush(batch, engine) == -1) {
+				return -1;
+			}
+		}
+		input->discarding = false; // the long line (if any) ended here
+		start = newline == NULL ? end : end + 1;
+	}
+	if (batch_flush(batch, engine) == -1) { // the lines point into the buffer, send them before it moves
+		return -1;
+	}
+
+	// moves the partial line to the front of the buffer
+	memmove(input->data, input->data + start, input->length - start);
+	input->length -= start;
+	if (input->length > 1023) { // a line this long can never be sent, drop it up to its newline
+		if (!input->discarding) {
+			print_error("Message must be between 1 amnd 1023 characters");
+		}
+		input->discarding = true;
+		input->length = 0;
+	}
+	return 0;
+}
+
+int input_consume(input_buffer_t* input, engine_t* engine, bool eof) {
+	// queues every complete line in the input buffer and keeps the partial line at the end
+	// at eof the partial line is queued as well
+	// returns 1 if a send queue filled up (the lines from there on stay buffered), -1 if writing to the server failed and 0 otherwise
+	size_t start = 0; // start of the current line
+	int result = 0;
+
+	while (start < input->length) {
+		char* newline = memchr(input->data + start, '\n', input->length - start);
+		if (newline == NULL && !eof) { // the rest of the line hasn't arrived yet
+			break;
+		}
+		size_t end = newline == NULL ? input->length : (size_t)(newline - input->data);
+		if (!input->discarding) {
+			result = engine_send_line(engine, input->data + start, end - start);
+		}
+		if (result == -1) {
+			return -1;
+		}
+		if (result == 1) { // retried once the queue has room
+			break;
+		}
+		input->discarding = false; // the long line (if any) ended here
+		start = newline == NULL ? end : end + 1;
+	}
+
+	// moves the partial line (or the lines still waiting for room) to the front of the buffer
+	memmove(input->data, input->data + start, input->length - start);
+	input->length -= start;
+	if (result == 0 && input->length > 1023) { // a line this long can never be sent, drop it up to its newline
+		if (!input->discarding) {
+			print_error("Message must be between 1 amnd 1023 characters");
+		}
+		input->discarding = true;
+		input->length = 0;
+	}
+	return result;
+}
+
+void batch_read_input(engine_t* engine) {
+	// batch mode replacement for the fgets loop: reads stdin in large blocks and sends complete lines paced and coalesced
+	// returns at EOF, on a shutdown or when writing to the server failed
+	static input_buffer_t input = {0};
+	static batch_t batch = {0};
+
+	while (settings.running) {
+		ssize_t bytes_read = read(STDIN_FILENO, input.data + input.length, INPUT_BUFFER_SIZE - input.length);
+		if (bytes_read == -1) {
+			if (errno == EINTR) { // a stats signal or a shutdown, the loop condition tells them apart
+				stats_poll(engine);
+				continue;
+			}
+			print_error(strerror(errno));
+			break;
+		}
+		input.length += bytes_read;
+		if (input_consume_batch(&input, &batch, engine, bytes_read == 0) == -1) {
+			if (settings.running) { // not interrupted by a shutdown while waiting for the rate limit
+				print_error("Failed to write to server");
+			}
+			break;
+		}
+		if (bytes_read == 0) { // EOF on stdin
+			break;
+		}
+	}
+}
+
+int engine_login(engine_t* engine) {
+	// sends the LOGIN of every session, called once whatever reads the sockets is ready for the history
+	// returns 0 on success and -1 on failure
+	for (size_t i = 0; i < engine->session_count; i++) {
+		if (session_login(engine->sessions[i]) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void uring_close(uring_t* uring) {
+	// cancels everything still in flight and unmaps the ring
+	if (uring->fd != -1) {
+		close(uring->fd);
+		uring->fd = -1;
+	}
+	if (uring->sq_ring != NULL) {
+		munmap(uring->sq_ring, uring->ring_size);
+		uring->sq_ring = NULL;
+	}
+	if (uring->sqes != NULL) {
+		munmap(uring->sqes, uring->sqes_size);
+		uring->sqes = NULL;
+	}
+	if (uring->buffers != NULL) {
+		munmap(uring->buffers, URING_BUFFERS * sizeof(struct io_uring_buf));
+		uring->buffers = NULL;
+	}
+	free(uring->buffer_data);
+	free(uring->sends);
+	free(uring->dirty);
+	uring->buffer_data = NULL;
+	uring->sends = NULL;
+	uring->dirty = NULL;
+}
+
+void uring_recycle(uring_t* uring, uint16_t id) {
+	// hands a receive buffer back to the kernel once its bytes were copied out
+	struct io_uring_buf* buffer = &uring->buffers->bufs[uring->buffer_tail & (URING_BUFFERS - 1)];
+	buffer->addr = (uint64_t)(uintptr_t)(uring->buffer_data + (size_t)id * URING_BUFFER_SIZE);
+	buffer->len = URING_BUFFER_SIZE;
+	buffer->bid = id;
+	uring->buffer_tail++;
+	atomic_thread_fence(memory_order_release); // the kernel must see the entry before the tail
+	uring->buffers->tail = uring->buffer_tail;
+}
+
+int uring_init(uring_t* uring, size_t sessions) {
+	// sets up the ring, registers the receive buffers and the send slots for every session
+	// returns 0 on success and -1 if io_uring is unavailable
+	struct io_uring_params params = {0};
+	int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (fd == -1) {
+		print_error(strerror(errno));
+		return -1;
+	}
+	uring->fd = fd;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+		print_error("io_uring is too old (needs a single ring mapping and no dropped completions)");
+		uring_close(uring);
+		return -1;
+	}
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sq_ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	uring->buffers = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (uring->sq_ring == MAP_FAILED || uring->sqes == MAP_FAILED || uring->buffers == MAP_FAILED) {
+		print_error(strerror(errno));
+		uring->sq_ring = uring->sq_ring == MAP_FAILED ? NULL : uring->sq_ring;
+		uring->sqes = uring->sqes == MAP_FAILED ? NULL : uring->sqes;
+		uring->buffers = uring->buffers == MAP_FAILED ? NULL : uring->buffers;
+		uring_close(uring);
+		return -1;
+	}
+	char* ring = uring->sq_ring;
+	uring->sq_head = (_Atomic unsigned*)(ring + params.sq_off.head);
+	uring->sq_tail = (_Atomic unsigned*)(ring + params.sq_off.tail);
+	uring->sq_array = (unsigned*)(ring + params.sq_off.array);
+	uring->sq_mask = *(unsigned*)(ring + params.sq_off.ring_mask);
+	uring->sq_entries = params.sq_entries;
+	uring->sq_local_tail = atomic_load(uring->sq_tail);
+	uring->sq_submitted = uring->sq_local_tail;
+	uring->cq_head = (_Atomic unsigned*)(ring + params.cq_off.head);
+	uring->cq_tail = (_Atomic unsigned*)(ring + params.cq_off.tail);
+	uring->cq_mask = *(unsigned*)(ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+	// every session may have a few frames waiting (LOGIN, a line, a KEEPALIVE, LOGOUT) at once
+	uring->send_count = (uint32_t)(sessions * 4 + 64);
+	uring->buffer_data = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+	uring->sends = malloc(uring->send_count * sizeof(uring_send_t));
+	uring->dirty = malloc(sessions * sizeof(session_t*));
+	if (uring->buffer_data == NULL || uring->sends == NULL || uring->dirty == NULL) { // checks if malloc failed
+		print_error("Failed to allocate io_uring buffers");
+		uring_close(uring);
+		return -1;
+	}
+	for (uint32_t i = 0; i < uring->send_count; i++) {
+		uring->sends[i].next = i + 1 < uring->send_count ? i + 1 : URING_NONE;
+	}
+	uring->send_free = 0;
+	uring->dirty_count = 0;
+
+	struct io_uring_buf_reg registration = {
+		.ring_addr = (uint64_t)(uintptr_t)uring->buffers,
+		.ring_entries = URING_BUFFERS,
+		.bgid = URING_BUFFER_GROUP,
+	};
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &registration, 1) == -1) {
+		print_error(strerror(errno));
+		uring_close(uring);
+		return -1;
+	}
+	uring->buffer_tail = 0;
+	for (uint16_t i = 0; i < URING_BUFFERS; i++) {
+		uring_recycle(uring, i);
+	}
+	return 0;
+}
+
+int uring_enter(uring_t* uring) {
+	// submits every sqe filled since the last call in one io_uring_enter, returns 0 on success and -1 on failure
+	unsigned pending = uring->sq_local_tail - uring->sq_submitted;
+	if (pending == 0) {
+		return 0;
+	}
+	atomic_store_explicit(uring->sq_tail, uring->sq_local_tail, memory_order_release); // publishes the filled sqes
+	while (pending > 0) {
+		long submitted = syscall(__NR_io_uring_enter, uring->fd, pending, 0, 0, NULL, 0);
+		uring->enters++;
+		if (submitted == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EBUSY) { // completions have to be reaped first, the rest goes with the next call
+				return 0;
+			}
+			print_error(strerror(errno));
+			return -1;
+		}
+		pending -= (unsigned)submitted;
+		uring->sq_submitted += (unsigned)submitted;
+	}
+	return 0;
+}
+
+struct io_uring_sqe* uring_sqe(uring_t* uring, unsigned needed) {
+	// the next free sqe, cleared, submitting what is filled first if fewer than needed are free
+	// (so a chain of linked sends never straddles two submissions)
+	// returns NULL on failure
+	unsigned head = atomic_load_explicit(uring->sq_head, memory_order_acquire);
+	if (uring->sq_entries - (uring->sq_local_tail - head) < needed) {
+		if (uring_enter(uring) == -1) {
+			return NULL;
+		}
+		head = atomic_load_explicit(uring->sq_head, memory_order_acquire);
+		if (uring->sq_local_tail - head == uring->sq_entries) { // the kernel didn't take any, nothing can be queued
+			print_error("io_uring submission queue is full");
+			return NULL;
+		}
+	}
+	unsigned index = uring->sq_local_tail & uring->sq_mask;
+	struct io_uring_sqe* sqe = &uring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[index] = index;
+	uring->sq_local_tail++;
+	return sqe;
+}
+
+int uring_arm_recv(uring_t* uring, session_t* session) {
+	// starts a multishot recv on the session's socket that completes once per chunk received into a provided buffer
+	// returns 0 on success and -1 on failure
+	struct io_uring_sqe* sqe = uring_sqe(uring, 1);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = session->socket_fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = URING_RECV << 56 | (uint64_t)session->uring_generation << 32 | session->uring_index;
+	return 0;
+}
+
+int uring_arm_stdin(uring_t* uring, char* data, size_t length) {
+	// starts one read of stdin into data, the event loop takes its result once uring_reap saw it complete
+	// returns 0 on success and -1 on failure
+	struct io_uring_sqe* sqe = uring_sqe(uring, 1);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = STDIN_FILENO;
+	sqe->off = (uint64_t)-1; // from the current position, so pipes, terminals and regular files all work
+	sqe->addr = (uint64_t)(uintptr_t)data;
+	sqe->len = (uint32_t)length;
+	sqe->user_data = URING_STDIN << 56;
+	uring->stdin_reading = true;
+	return 0;
+}
+
+int uring_probe_recv(uring_t* uring) {
+	// receives one byte from a socketpair with a multishot recv: the ring and provided buffers work from 5.19 on,
+	// but multishot receives only from 6.0, before that every one of them would complete with EINVAL
+	// returns 0 if multishot receives work and -1 if not (the ring is left without completions either way)
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+		print_error(strerror(errno));
+		return -1;
+	}
+	int status = -1;
+	struct io_uring_sqe* sqe = uring_sqe(uring, 1);
+	if (sqe != NULL && write(pair[1], "", 1) == 1) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = pair[0];
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+		if (uring_enter(uring) == 0) {
+			status = 0;
+		}
+	}
+	bool more = status == 0; // a completion is still due for the probe
+	while (more) {
+		unsigned head = atomic_load_explicit(uring->cq_head, memory_order_relaxed);
+		if (head == atomic_load_explicit(uring->cq_tail, memory_order_acquire)) {
+			if (syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR) {
+				print_error(strerror(errno));
+				status = -1;
+				break;
+			}
+			continue;
+		}
+		struct io_uring_cqe cqe = uring->cqes[head & uring->cq_mask];
+		atomic_store_explicit(uring->cq_head, head + 1, memory_order_release);
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			uring_recycle(uring, (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+		}
+		if (cqe.res < 0 && status == 0) {
+			print_error(cqe.res == -EINVAL ? "io_uring has no multishot receives (needs Linux 6.0)" : strerror(-cqe.res));
+			status = -1;
+		}
+		more = cqe.flags & IORING_CQE_F_MORE;
+		if (more) { // the recv is still armed, ending the socket ends it
+			shutdown(pair[0], SHUT_RDWR);
+		}
+	}
+	close(pair[0]);
+	close(pair[1]);
+	return status;
+}
+
+int session_watch(session_t* session, int epoll_fd, uint64_t tag) {
+	// starts receiving on a newly connected session's socket: a multishot recv with --io-uring, otherwise epoll
+	// returns 0 on success and -1 on failure
+	if (uring.fd != -1) {
+		session->uring_index = (uint32_t)tag;
+		return uring_arm_recv(&uring, session);
+	}
+	struct epoll_event event = { .events = EPOLLIN, .data.u64 = tag };
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->socket_fd, &event);
+}
+
+void session_unwatch(session_t* session, int epoll_fd) {
+	// stops receiving on a session's socket before it is closed
+	if (uring.fd == -1) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->socket_fd, NULL);
+		return;
+	}
+	shutdown(session->socket_fd, SHUT_RDWR); // ends the multishot recv, it holds the socket open past close otherwise
+	session->uring_generation++; // whatever still completes for this socket is ignored
+	session->sends_in_flight = 0;
+	while (session->send_head != URING_NONE) { // frames that were never submitted
+		uint32_t slot = session->send_head;
+		session->send_head = uring.sends[slot].next;
+		uring.sends[slot].next = uring.send_free;
+		uring.send_free = slot;
+	}
+	session->send_tail = URING_NONE;
+}
+
+void engine_close_session(engine_t* engine, session_t* session, int epoll_fd) {
+	// stops polling a session whose connection ended and closes its socket
+	if (session->socket_fd == -1) {
+		return;
+	}
+	session_unwatch(session, epoll_fd);
+	close(session->socket_fd);
+	session->socket_fd = -1;
+	session->logged_out = true;
+	engine->open_count--;
+}
+
+void session_lost(session_t* session, int epoll_fd) {
+	// closes the socket of a session whose connection ended and schedules a reconnect with jittered exponential backoff
+	// the session stays counted as open so the event loop keeps running
+	if (session->socket_fd != -1) {
+		session_unwatch(session, epoll_fd);
+		close(session->socket_fd);
+		session->socket_fd = -1;
+	}
+	session->logged_out = true; // nothing may be sent until the next LOGIN
+
+	unsigned int doublings = session->reconnect_attempts < 16 ? session->reconnect_attempts : 16;
+	uint64_t backoff_ms = (uint64_t)RECONNECT_INITIAL_MS << doublings;
+	if (backoff_ms > RECONNECT_MAX_MS) {
+		backoff_ms = RECONNECT_MAX_MS;
+	}
+	uint64_t delay_ms = backoff_ms / 2 + (uint64_t)random() % (backoff_ms / 2 + 1); // jitter spreads out sessions that lost the server together
+	session->reconnect_ns = monotonic_ns() + delay_ms * 1000000ULL;
+
+	if (session->render) {
+		message_t notice = { .message_type = SYSTEM };
+		snprintf(notice.message, sizeof(notice.message), "%s, reconnecting in %.1f s",
+			session->reconnect_attempts == 0 ? "Connection lost" : "Reconnect failed", delay_ms / 1e3);
+		render_message(&renderer, &notice, NULL);
+	}
+	session->reconnect_attempts++;
+}
+
+void session_reconnect(session_t* session, const settings_t* settings, int epoll_fd, uint64_t tag) {
+	// connects and logs in a lost session again, the history that follows is deduplicated against what was rendered
+	// schedules another attempt if this one fails
+	session->reconnect_ns = 0;
+	session->receive.start = 0;
+	session->receive.end = 0;
+	session->compact = false; // negotiated again by the new LOGIN
+	session->keepalive = false;
+	session->logged_out = false;
+	session->first_frame_ns = 0;
+	session->history_done_ns = 0;
+	session->resuming = true;
+
+	if (session_connect(session, settings) == -1 || session_watch(session, epoll_fd, tag) == -1
+			|| session_login(session) == -1) {
+		session_lost(session, epoll_fd);
+	}
+}
+
+uint64_t engine_reconnect_due(engine_t* engine, int epoll_fd) {
+	// reconnects the lost sessions whose backoff has passed
+	// returns the monotonic time of the next pending attempt, 0 if there is none
+	uint64_t next = 0;
+	for (size_t i = 0; i < engine->session_count; i++) {
+		session_t* session = engine->sessions[i];
+		if (session->reconnect_ns != 0 && session->reconnect_ns <= monotonic_ns()) {
+			session_reconnect(session, &settings, epoll_fd, i);
+		}
+		if (session->reconnect_ns != 0 && (next == 0 || session->reconnect_ns < next)) {
+			next = session->reconnect_ns;
+		}
+	}
+	return next;
+}
+
+uint64_t engine_keepalive_due(engine_t* engine) {
+	// sends KEEPALIVE from the sessions that have been quiet for the interval
+	// returns the monotonic time the next one is due, 0 if no session sends them
+	uint64_t next = 0;
+	for (size_t i = 0; i < engine->session_count; i++) {
+		session_t* session = engine->sessions[i];
+		if (!session->keepalive || session->logged_out || session->socket_fd == -1) {
+			continue;
+		}
+		if (session->keepalive_ns <= monotonic_ns()) {
+			if (send_message(session, KEEPALIVE, NULL, NULL, 0) == -1) { // a dead connection shows up on the read side
+				print_error("Failed to send keepalive to server");
+				keepalive_schedule(session, false);
+			} else {
+				session->stats.keepalives++;
+			}
+		}
+		if (next == 0 || session->keepalive_ns < next) {
+			next = session->keepalive_ns;
+		}
+	}
+	return next;
+}
+
+void engine_receive_result(engine_t* engine, session_t* session, int result, int epoll_fd, int* status) {
+	// deals with a session whose receive (or io_uring send) ended it: a reconnect later or closing it for good
+	if (result == 0) {
+		return;
+	}
+	if (settings.reconnect && settings.running) { // lost, not shutting down: try again later
+		session_lost(session, epoll_fd);
+		return;
+	}
+	if (result == -1) { // disconnected by the server, closed or failed, no LOGOUT may be sent now
+		*status = -1;
+	}
+	engine_close_session(engine, session, epoll_fd);
+}
+
+int uring_submit(uring_t* uring) {
+	// links the pending frames of every session without sends in flight into one chain each, so a session's
+	// frames go out in order and a failed one cancels the rest, then submits everything in one io_uring_enter
+	// returns 0 on success and -1 on failure
+	size_t kept = 0;
+	for (size_t i = 0; i < uring->dirty_count; i++) {
+		session_t* session = uring->dirty[i];
+		if (session->send_head == URING_NONE || session->socket_fd == -1) { // sent already or dropped with the socket
+			session->send_dirty = false;
+			continue;
+		}
+		if (session->sends_in_flight > 0) { // waits for the chain in flight, two chains could overtake each other
+			uring->dirty[kept++] = session;
+			continue;
+		}
+		unsigned length = 0;
+		for (uint32_t slot = session->send_head; slot != URING_NONE; slot = uring->sends[slot].next) {
+			length++;
+		}
+		for (uint32_t slot = session->send_head; slot != URING_NONE; slot = uring->sends[slot].next) {
+			struct io_uring_sqe* sqe = uring_sqe(uring, length);
+			if (sqe == NULL) {
+				return -1;
+			}
+			length = 0; // the rest of the chain fits now
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = session->socket_fd;
+			sqe->addr = (uint64_t)(uintptr_t)uring->sends[slot].data;
+			sqe->len = (uint32_t)uring->sends[slot].length;
+			sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL; // a short send is retried by the kernel, a closed socket fails with EPIPE
+			sqe->flags = uring->sends[slot].next != URING_NONE ? IOSQE_IO_LINK : 0;
+			sqe->user_data = URING_SEND << 56 | slot;
+			session->sends_in_flight++;
+		}
+		session->send_head = URING_NONE;
+		session->send_tail = URING_NONE;
+		session->send_dirty = false;
+	}
+	uring->dirty_count = kept;
+	return uring_enter(uring);
+}
+
+void uring_reap(uring_t* uring, engine_t* engine, int epoll_fd, int* status) {
+	// handles every completion in the ring: received bytes go through the usual frame parsing and rendering,
+	// finished sends free their slot, completions for a socket that went away since are dropped
+	unsigned head = atomic_load_explicit(uring->cq_head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(uring->cq_tail, memory_order_acquire);
+	for (; head != tail; head++) {
+		struct io_uring_cqe cqe = uring->cqes[head & uring->cq_mask];
+		uring->completions++;
+		if (cqe.user_data >> 56 == URING_STDIN) {
+			uring->stdin_reading = false;
+			uring->stdin_done = true;
+			uring->stdin_result = cqe.res;
+			continue;
+		}
+		if (cqe.user_data >> 56 == URING_SEND) {
+			uint32_t slot = (uint32_t)cqe.user_data;
+			uring_send_t* send = &uring->sends[slot];
+			session_t* session = send->session;
+			bool current = send->generation == session->uring_generation && session->socket_fd != -1;
+			size_t length = send->length;
+			send->next = uring->send_free;
+			uring->send_free = slot;
+			if (!current) {
+				continue;
+			}
+			session->sends_in_flight--;
+			if (cqe.res > 0) {
+				session->stats.bytes_written += (uint64_t)cqe.res;
+			}
+			if (cqe.res != (int32_t)length) { // failed, short or canceled because a send before it in the chain failed
+				if (cqe.res >= 0) {
+					session->stats.short_writes++;
+				}
+				if (session->logged_out || !settings.running) { // LOGOUT went out or the server ended the session
+					engine_receive_result(engine, session, 1, epoll_fd, status);
+				} else {
+					print_error(cqe.res < 0 ? strerror(-cqe.res) : "Short write");
+					print_error("Failed to write to server");
+					engine_receive_result(engine, session, -1, epoll_fd, status);
+				}
+			}
+			continue;
+		}
+
+		session_t* session = engine->sessions[(uint32_t)cqe.user_data];
+		bool current = (uint16_t)(cqe.user_data >> 32) == session->uring_generation && session->socket_fd != -1;
+		int result = 0;
+		if (current && cqe.res > 0) {
+			uint16_t id = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			result = session_receive_bytes(session, uring->buffer_data + (size_t)id * URING_BUFFER_SIZE, (size_t)cqe.res);
+		} else if (current && cqe.res == 0) { // the server closed the connection
+			result = receive_ended(session);
+		} else if (current && cqe.res != -ENOBUFS) {
+			print_error(strerror(-cqe.res));
+			result = receive_ended(session);
+		}
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			uring_recycle(uring, (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+		}
+		if (result == 0 && current && session->socket_fd != -1 && !(cqe.flags & IORING_CQE_F_MORE) // the multishot ended,
+				&& uring_arm_recv(uring, session) == -1) { // e.g. every provided buffer was in use (ENOBUFS)
+			result = -1;
+		}
+		engine_receive_result(engine, session, result, epoll_fd, status);
+	}
+	atomic_store_explicit(uring->cq_head, head, memory_order_release); // the kernel may reuse the entries
+}
+
+#define EVENT_STDIN UINT64_MAX // epoll tag for stdin, sessions are tagged with their index
+#define EVENT_URING (UINT64_MAX - 2) // epoll tag for the io_uring, readable while it has completions
+#define EVENT_SIGNAL (UINT64_MAX - 1) // epoll tag for the signalfd
+
+int run_event_loop(engine_t* engine) {
+	// single threaded alternative to the receive thread: stdin, every session's socket and signals go through one epoll
+	// (with --io-uring the sockets and stdin are read on the ring and epoll only waits for it and the signalfd)
+	// returns 0 on a clean shutdown and -1 on failure
+	static input_buffer_t input = {0};
+	int status = 0;
+
+	// SIGINT/SIGTERM (and the stats signals) are read from a signalfd instead of interrupting syscalls
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGALRM);
+	if (sigprocmask(SIG_BLOCK, &signals, NULL) == -1) {
+		print_error(strerror(errno));
+		return -1;
+	}
+	int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (signal_fd == -1 || epoll_fd == -1) {
+		print_error(strerror(errno));
+		close(signal_fd);
+		close(epoll_fd);
+		return -1;
+	}
+
+	struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_SIGNAL };
+	bool failed = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1;
+	if (!failed && settings.io_uring) { // the sockets are served by the ring, epoll only says when it has completions
+		if (uring_init(&uring, engine->session_count) == -1 || uring_probe_recv(&uring) == -1) {
+			uring_close(&uring);
+			print_error("io_uring is unavailable, using epoll");
+		} else {
+			event = (struct epoll_event){ .events = EPOLLIN, .data.u64 = EVENT_URING };
+			failed = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uring.fd, &event) == -1;
+		}
+	}
+	for (size_t i = 0; i < engine->session_count && !failed; i++) {
+		failed = session_watch(engine->sessions[i], epoll_fd, i) == -1;
+	}
+	bool stdin_polled = true; // regular files and /dev/null can't be polled, they are always readable
+	bool stdin_open = !settings.bench; // false after EOF on stdin, the bench doesn't read stdin at all
+	bool stdin_blocked = false; // a send queue is full, stdin isn't read until the buffered lines fit
+	bool stdin_watched = stdin_open && uring.fd == -1; // stdin is in the epoll set, with --io-uring it is read on the ring
+	event = (struct epoll_event){ .events = EPOLLIN, .data.u64 = EVENT_STDIN };
+	if (!failed && stdin_watched && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1) {
+		stdin_polled = false;
+		stdin_watched = false;
+		failed = errno != EPERM;
+	}
+	if (failed) {
+		print_error(strerror(errno));
+		uring_close(&uring);
+		close(signal_fd);
+		close(epoll_fd);
+		return -1;
+	}
+	engine->open_count = engine->session_count;
+	if (engine_login(engine) == -1) { // the sockets are polled already, the history is read as soon as it arrives
+		uring_close(&uring);
+		close(signal_fd);
+		close(epoll_fd);
+		return -1;
+	}
+	if (settings.bench && bench_start(engine) == -1) {
+		uring_close(&uring);
+		close(signal_fd);
+		close(epoll_fd);
+		return -1;
+	}
+
+	bool logged_out = false; // LOGOUT was sent, waiting for the server to close the sockets
+	uint64_t deadline = 0; // next bench deadline, 0 when nothing is scheduled
+	uint64_t reconnect_deadline = 0; // next reconnect attempt, 0 when no session is waiting for one
+	uint64_t keepalive_deadline = 0; // next KEEPALIVE, 0 when no session sends them
+	uint64_t send_deadline = 0; // next queued line that gets a token, 0 when nothing is queued
+	while (engine->open_count > 0) {
+		if (uring.fd != -1 && stdin_open && !stdin_blocked && settings.running && !uring.stdin_reading && !uring.stdin_done
+				&& uring_arm_stdin(&uring, input.data + input.length, INPUT_BUFFER_SIZE - input.length) == -1) {
+			status = -1;
+			break;
+		}
+		if (uring.fd != -1 && uring_submit(&uring) == -1) { // the frames queued and recvs re-armed since the last iteration
+			status = -1;
+			break;
+		}
+		struct epoll_event events[64];
+		int timeout = stdin_open && !stdin_polled && !stdin_blocked ? 0 : -1;
+		uint64_t next = earliest_deadline(earliest_deadline(deadline, reconnect_deadline), keepalive_deadline);
+		next = earliest_deadline(next, send_deadline);
+		next = earliest_deadline(next, render_deadline(&renderer));
+		if (next != 0 && timeout == -1) {
+			timeout = timeout_until(next);
+		}
+		int count = epoll_wait(epoll_fd, events, 64, timeout);
+		if (count == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			print_error(strerror(errno));
+			status = -1;
+			break;
+		}
+
+		bool stdin_ready = stdin_open && !stdin_polled && !stdin_blocked;
+		for (int i = 0; i < count; i++) {
+			uint64_t tag = events[i].data.u64;
+			if (tag == EVENT_SIGNAL) { // SIGINT, SIGTERM, SIGUSR1 or SIGALRM
+				struct signalfd_siginfo info;
+				if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+					handle_signal((int)info.ssi_signo); // same flags as the threaded mode
+					stats_poll(engine);
+				}
+			} else if (tag == EVENT_STDIN) {
+				stdin_ready = true;
+			} else if (tag == EVENT_URING) {
+				uring_reap(&uring, engine, epoll_fd, &status);
+				stdin_ready = stdin_ready || (uring.stdin_done && stdin_open);
+			} else {
+				session_t* session = engine->sessions[tag];
+				if (session->socket_fd == -1) { // closed earlier in this batch
+					continue;
+				}
+				engine_receive_result(engine, session, session_receive(session), epoll_fd, &status);
+			}
+		}
+		if (render_due(&renderer) && render_flush(&renderer) == -1) { // one write for everything received in this iteration
+			print_error("Failed to write message to stdout");
+			status = -1;
+			break;
+		}
+		if (engine->session_count == 1 && engine->open_count == 0) { // the only session ended
+			break;
+		}
+		if (settings.bench && settings.running) { // sends the bench messages that are due
+			deadline = bench_tick(engine);
+		}
+		if (settings.reconnect && settings.running) {
+			reconnect_deadline = engine_reconnect_due(engine, epoll_fd);
+		}
+		if (settings.keepalive_interval && settings.running) {
+			keepalive_deadline = engine_keepalive_due(engine);
+		}
+
+		if (settings.running) { // sends the queued lines that got their token
+			send_deadline = engine_send_due(engine);
+		}
+
+		int consumed = 0;
+		if (stdin_blocked && settings.running) { // retries the buffered lines now that tokens came in
+			consumed = input_consume(&input, engine, !stdin_open);
+		} else if (stdin_ready && settings.running) { // reads whatever stdin has into the input buffer
+			ssize_t bytes_read;
+			if (uring.fd != -1) { // the ring read it already
+				uring.stdin_done = false;
+				bytes_read = uring.stdin_result < 0 ? -1 : uring.stdin_result;
+				errno = uring.stdin_result < 0 ? -uring.stdin_result : 0;
+			} else {
+				bytes_read = read(STDIN_FILENO, input.data + input.length, INPUT_BUFFER_SIZE - input.length);
+			}
+			if (bytes_read == -1 && errno != EINTR) {
+				print_error(strerror(errno));
+				bytes_read = 0; // treats a broken stdin like EOF
+			}
+			if (bytes_read >= 0) {
+				input.length += bytes_read;
+				consumed = input_consume(&input, engine, bytes_read == 0);
+				if (bytes_read == 0) { // EOF on stdin, the client quits once the queued lines went out
+					stdin_open = false;
+				}
+			}
+		}
+		if (consumed == -1) {
+			print_error("Failed to write to server");
+			settings.running = false;
+		}
+		stdin_blocked = consumed == 1;
+		if (settings.running) { // includes the lines queued just now
+			send_deadline = engine_send_due(engine);
+		}
+		if (!stdin_open && !settings.bench && !stdin_blocked && settings.running && engine_send_pending(engine) == 0) {
+			settings.running = false; // everything read from stdin was sent
+		}
+		if (uring.fd == -1 && stdin_watched != (stdin_polled && stdin_open && !stdin_blocked && settings.running)) { // a full queue stops reading stdin
+			event = (struct epoll_event){ .events = EPOLLIN, .data.u64 = EVENT_STDIN };
+			epoll_ctl(epoll_fd, stdin_watched ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, STDIN_FILENO, &event);
+			stdin_watched = !stdin_watched;
+		}
+
+		if (!settings.running && !logged_out) { // EOF, a signal or an error: log out and wait for the server to close
+			stdin_open = false;
+			logged_out = true;
+			reconnect_deadline = 0;
+			keepalive_deadline = 0;
+			send_deadline = 0; // lines still queued are dropped
+			for (size_t i = 0; i < engine->session_count; i++) {
+				if (engine->sessions[i]->reconnect_ns != 0) { // gives up on the pending reconnect
+					engine->sessions[i]->reconnect_ns = 0;
+					engine->open_count--;
+				}
+				if (session_logout(engine->sessions[i]) == -1) {
+					status = -1;
+					engine_close_session(engine, engine->sessions[i], epoll_fd);
+				}
+			}
+		}
+	}
+
+	if (render_flush(&renderer) == -1 && status == 0) { // what --refresh-ms still held back
+		print_error("Failed to write message to stdout");
+		status = -1;
+	}
+	uring_close(&uring);
+	close(signal_fd);
+	close(epoll_fd);
+	return status;
+}
+
+void engine_destroy(engine_t* engine) {
+	// closes and frees every session
+	for (size_t i = 0; i < engine->session_count; i++) {
+		session_destroy(engine->sessions[i]);
+	}
+	free(engine->sessions);
+	engine->sessions = NULL;
+	engine->session_count = 0;
+}
+
+int engine_start(engine_t* engine, const settings_t* settings) {
+	// creates and connects settings->session_count sessions, engine_login logs them in
+	// a single session uses the username as is, otherwise the sessions are USERNAME1..USERNAMEN
+	// returns 0 on success and -1 on failure
+	engine->sessions = calloc(settings->session_count, sizeof(session_t*));
+	if (engine->sessions == NULL) { // checks if calloc failed
+		print_error("Failed to allocate sessions");
+		return -1;
+	}
+	engine->session_count = settings->session_count;
+
+	for (size_t i = 0; i < settings->session_count; i++) {
+		char username[32];
+		if (settings->session_count == 1) {
+			strncpy(username, settings->username, sizeof(username));
+		} else {
+			// keeps the index in the 31 usable characters by cutting the base name short
+			char suffix[24];
+			int suffix_length = snprintf(suffix, sizeof(suffix), "%zu", i + 1);
+			snprintf(username, sizeof(username), "%.*s%s", (int)(sizeof(username) - 1 - suffix_length), settings->username, suffix);
+		}
+		engine->sessions[i] = session_create(settings, username, i == 0 && !settings->bench);
+		if (engine->sessions[i] == NULL || session_connect(engine->sessions[i], settings) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#define REPLAY_CHUNK_FRAMES 64 // converted frames written to the replay memfd at once
+
+typedef struct ReplayWriter {
+	// converts a capture into the fixed size frames the server would have sent, in network byte order
+	int fd; // memfd the frames are written to
+	message_t frames[REPLAY_CHUNK_FRAMES];
+	size_t count; // frames waiting to be written
+	size_t total; // frames converted so far
+} replay_writer_t;
+
+int replay_flush(replay_writer_t* writer) {
+	// writes the converted frames to the memfd, returns 0 on success and -1 on failure
+	size_t length = writer->count * sizeof(message_t);
+	if (length > 0 && perform_full_write(writer->frames, length, writer->fd, NULL) != (ssize_t)length) {
+		print_error("Failed to write the replay frames");
+		return -1;
+	}
+	writer->count = 0;
+	return 0;
+}
+
+int replay_add(replay_writer_t* writer, const message_t* message) {
+	// queues a frame in host byte order for the memfd, returns 0 on success and -1 on failure
+	message_t* frame = &writer->frames[writer->count++];
+	*frame = *message;
+	frame->message_type = htonl(message->message_type);
+	frame->timestamp = htonl(message->timestamp);
+	writer->total++;
+	return writer->count == REPLAY_CHUNK_FRAMES ? replay_flush(writer) : 0;
+}
+
+int replay_convert_cache(replay_writer_t* writer, int fd) {
+	// converts the frames of a --cache file, returns 0 on success and -1 on failure
+	cache_header_t header;
+	if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || header.version != CACHE_VERSION
+			|| header.frame_size != sizeof(message_t)) {
+		print_error("Not a message cache file (or from an incompatible version)");
+		return -1;
+	}
+	off_t offset = sizeof(header);
+	for (uint64_t i = 0; i < header.frame_count; i++, offset += sizeof(message_t)) {
+		message_t message;
+		if (pread(fd, &message, sizeof(message), offset) != (ssize_t)sizeof(message)) {
+			print_error("Message cache file is truncated");
+			return -1;
+		}
+		if (replay_add(writer, &message) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int replay_convert_log(replay_writer_t* writer, int fd, size_t* skipped) {
+	// converts the MESSAGE_SEND entries of a server messages.log ("ip|type|timestamp|username|message" per line)
+	// into the MESSAGE_RECV frames the server sends them as in the history
+	// returns 0 on success and -1 on failure
+	FILE* log = fdopen(dup(fd), "r");
+	if (log == NULL) {
+		print_error(strerror(errno));
+		return -1;
+	}
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	int result = 0;
+	while (result == 0 && (length = getline(&line, &capacity, log)) != -1) {
+		if (length > 0 && line[length - 1] == '\n') { // get rid of newline character
+			line[--length] = '\0';
+		}
+		char* fields[5] = { line };
+		size_t count = 1;
+		for (char* cursor = line; count < 5 && (cursor = strchr(cursor, '|')) != NULL; count++) { // the message may contain '|'
+			*cursor++ = '\0';
+			fields[count] = cursor;
+		}
+		if (count < 5) { // not an entry
+			(*skipped)++;
+			continue;
+		}
+		if (atoi(fields[1]) != MESSAGE_SEND) { // only sends are history
+			continue;
+		}
+		message_t message = { .message_type = MESSAGE_RECV, .timestamp = (uint32_t)strtoul(fields[2], NULL, 10) };
+		strncpy(message.username, fields[3], sizeof(message.username) - 1);
+		strncpy(message.message, fields[4], sizeof(message.message) - 1);
+		result = replay_add(writer, &message);
+	}
+	free(line);
+	fclose(log);
+	return result;
+}
+
+int replay_open(const char* path, bool* compact, size_t* skipped) {
+	// opens a capture for --replay: raw frames as the server sent them are read as they are,
+	// a --cache file or a server messages.log is first converted into frames in a memfd
+	// sets compact for a capture of compact frames, returns the descriptor to read or -1 on failure
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		print_error(strerror(errno));
+		print_error("Failed to open the replay file");
+		return -1;
+	}
+	char magic[sizeof(((cache_header_t*)NULL)->magic)];
+	ssize_t peeked = pread(fd, magic, sizeof(magic), 0);
+	if (peeked == -1 && errno == ESPIPE) { // a pipe can't be peeked at, it has to carry fixed size frames
+		return fd;
+	}
+	bool cache_file = peeked == (ssize_t)sizeof(magic) && memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0;
+	if (peeked > 0 && !cache_file && (magic[0] == '\0' || ((uint8_t)magic[0] & COMPACT_FLAG))) { // a frame type's high byte
+		*compact = (uint8_t)magic[0] & COMPACT_FLAG;
+		return fd;
+	}
+
+	replay_writer_t* writer = malloc(sizeof(replay_writer_t));
+	if (writer == NULL) { // checks if malloc failed
+		print_error("Failed to allocate the replay buffer");
+		close(fd);
+		return -1;
+	}
+	writer->count = 0;
+	writer->total = 0;
+	writer->fd = memfd_create("replay", MFD_CLOEXEC);
+	int result = writer->fd == -1 ? -1 : cache_file ? replay_convert_cache(writer, fd) : replay_convert_log(writer, fd, skipped);
+	if (writer->fd == -1) {
+		print_error(strerror(errno));
+	}
+	if (result == 0) {
+		result = replay_flush(writer);
+	}
+	if (result == 0 && lseek(writer->fd, 0, SEEK_SET) == -1) { // reads start from the first frame
+		print_error(strerror(errno));
+		result = -1;
+	}
+	close(fd);
+	int replay_fd = writer->fd;
+	free(writer);
+	if (result == -1 && replay_fd != -1) {
+		close(replay_fd);
+	}
+	return result == -1 ? -1 : replay_fd;
+}
+
+void replay_report(const stats_t* stats, double seconds, size_t skipped) {
+	// prints the throughput of a replay and what every stage cost per message to stderr
+	double frames = stats->frames_read ? (double)stats->frames_read : 1;
+	fprintf(stderr, "replay: %llu messages, %llu bytes in %.3f s, %.0f messages/s, %.1f MB/s",
+		(unsigned long long)stats->frames_read, (unsigned long long)stats->bytes_read, seconds,
+		seconds > 0 ? stats->frames_read / seconds : 0, seconds > 0 ? stats->bytes_read / seconds / 1e6 : 0);
+	if (skipped > 0) {
+		fprintf(stderr, ", %zu malformed log lines skipped", skipped);
+	}
+	fprintf(stderr, "\n  receive: %.3f us per message reading, parsing and queueing (%llu read calls),"
+		" plus %.3f us waiting %llu times for the render thread\n",
+		(stats->receive_ns - stats->queue_wait_ns) / 1e3 / frames, (unsigned long long)stats->read_calls,
+		stats->queue_wait_ns / 1e3 / frames, (unsigned long long)stats->queue_waits);
+	fprintf(stderr, "  store:   %.3f us per message appending to the cache and search index\n", stats->store_ns / 1e3 / frames);
+	fprintf(stderr, "  render:  %.3f us per message formatting\n", stats->render_ns / 1e3 / frames);
+	fprintf(stderr, "  write:   %.3f us per message writing caught up batches to stdout\n", stats->flush_ns / 1e3 / frames);
+}
+
+int run_replay(void) {
+	// drives the threaded receive and render pipeline from settings.replay_path instead of a server,
+	// the receive thread reads the capture as fast as it can and waits for the render thread instead of dropping
+	// returns 0 on success and -1 on failure
+	bool compact = false;
+	size_t skipped = 0;
+	int fd = replay_open(settings.replay_path, &compact, &skipped);
+	if (fd == -1) {
+		return -1;
+	}
+	session_t* session = session_create(&settings, settings.username, true);
+	if (session == NULL) {
+		close(fd);
+		return -1;
+	}
+	session->socket_fd = fd;
+	session->compact = compact;
+	session->logged_out = true; // the end of the capture ends the replay, nothing is ever sent
+	frame_pool_init(&frame_pool);
+	if (frame_queue_init(&frame_queue) == -1) {
+		session_destroy(session);
+		return -1;
+	}
+	session->queue = &frame_queue;
+
+	settings.running = true;
+	uint64_t started = monotonic_ns();
+	pthread_t receive_messages;
+	pthread_t render_messages;
+	void* status = NULL;
+	void* render_status = NULL;
+	int created = pthread_create(&render_messages, NULL, render_messages_thread, session);
+	if (created == 0) {
+		created = pthread_create(&receive_messages, NULL, receive_messages_thread, session);
+		if (created != 0) { // the render thread exits once the queue is closed
+			frame_queue_close(&frame_queue);
+			pthread_join(render_messages, NULL);
+		}
+	}
+	if (created != 0) { // checks for failure
+		print_error("Failed to create recieve messages thread");
+		session_destroy(session);
+		return -1;
+	}
+	pthread_join(receive_messages, &status);
+	pthread_join(render_messages, &render_status);
+	double seconds = (monotonic_ns() - started) / 1e9;
+
+	replay_report(&session->stats, seconds, skipped);
+	engine_t engine = { .sessions = &session, .session_count = 1 };
+	stats_print(&engine, false);
+	session_destroy(session); // closes the capture
+	return status != NULL || render_status != NULL ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	// setup sigactions (ill-advised to use signal for this project, use sigaction with default (0) flags instead)
+	struct sigaction sa = {0}; 
+	sa.sa_handler = handle_signal;
+	if (sigaction(SIGINT, &sa, NULL) == -1) { // sets up SIGINT handler and checks for error
+		print_error("Failure to setup SIGINT signal handler");
+		return -1;
+	}
+	if (sigaction(SIGTERM, &sa, NULL) == -1) { // sets up SIGTERM handler and checks for error
+		print_error("Failure to setup SIGTERM signal handler"); 
+		return -1;
+	}
+	if (sigaction(SIGUSR1, &sa, NULL) == -1 || sigaction(SIGALRM, &sa, NULL) == -1) { // stats signals
+		print_error("Failure to setup stats signal handlers");
+		return -1;
+	}
+	start_ns = monotonic_ns();
+	tzset(); // localtime_r relies on the timezone being loaded up front
+	
+	// set up default settings
+	settings.server.sin_family = AF_INET; // defaults address family to IPv4
+	settings.server.sin_port = htons(8080); // defaults port to 8080 in network byte order
+	settings.quiet = false; // defaults quiet to false
+	settings.running = false; // defaults running to false
+	settings.session_count = 1; // defaults to a single session
+	settings.bench_rate = 2; // defaults to 2 bench messages per second per session
+	settings.bench_duration = 10; // defaults to a 10 second bench
+	settings.connect_timeout = 10; // defaults to giving up on a connect after 10 seconds
+	settings.send_rate = SEND_RATE_DEFAULT; // defaults to pacing that the server's 5 per second limit never disconnects
+	settings.send_burst = SEND_BURST_DEFAULT;
+	inet_pton(AF_INET, "127.0.0.1", &(settings.server.sin_addr)); // defaults ip address to 127.0.0.1
+
+	// parse arguments
+	if (process_args(argc, argv, &settings) == -1) { // checks if processing arguments failed  
+		return -1;
+	}
+
+	if (settings.address_count == 0) { // --ip or the default, a single address to connect to
+		settings.addresses[0] = settings.server.sin_addr;
+		settings.address_count = 1;
+	}
+
+	if (settings.batch && (settings.event_loop || settings.bench || settings.session_count > 1 || settings.reconnect
+			|| settings.keepalive_interval || settings.io_uring)) {
+		print_error("--batch can't be combined with --event-loop, --sessions, --bench, --reconnect, --keepalive or --io-uring");
+		return -1;
+	}
+	if (settings.replay_path != NULL && (settings.event_loop || settings.bench || settings.session_count > 1 || settings.batch
+			|| settings.reconnect || settings.keepalive_interval || settings.io_uring || settings.scrollback || settings.since_set)) {
+		print_error("--replay can't be combined with --event-loop, --sessions, --bench, --batch, --reconnect, --keepalive,"
+			" --io-uring, --scrollback or --since");
+		return -1;
+	}
+	if (settings.replay_path != NULL) { // the stage timing is only taken while stats are on
+		settings.stats = true;
+	}
+	if (settings.io_uring) { // the ring is driven by the event loop
+		settings.event_loop = true;
+	}
+	if (settings.reconnect || settings.keepalive_interval) { // reconnects and keepalives are scheduled on the event loop
+		settings.event_loop = true;
+		srandom((unsigned int)(monotonic_ns() ^ (uint64_t)getpid())); // jitter differs between clients
+	}
+	if (settings.reconnect) {
+		struct sigaction ignore = { .sa_handler = SIG_IGN }; // a write racing a dropped connection fails with EPIPE instead of killing the client
+		sigaction(SIGPIPE, &ignore, NULL);
+	}
+
+	if ((settings.scrollback || settings.since_set) && settings.cache_path == NULL) {
+		print_error("--scrollback and --since need --cache");
+		return -1;
+	}
+
+	// get username
+	if (get_username(&settings) == -1) { // checks if get_username failed
+		return -1;
+	}
+
+	if (settings.cache_path != NULL && !settings.bench) { // deep scrollback straight from disk
+		if (cache_open(&cache, settings.cache_path) == -1) {
+			return -1;
+		}
+		if (!settings.since_set && index_open(&search_index, &cache, settings.cache_path) == -1) {
+			cache_close(&cache);
+			return -1;
+		}
+		mention_pattern_t mention;
+		mention_init(&mention, settings.username);
+		size_t count = cache_header(&cache)->frame_count;
+		size_t from = settings.since_set ? cache_lower_bound(&cache, (uint32_t)settings.since)
+			: count - (settings.scrollback < count ? settings.scrollback : count);
+		if ((settings.since_set || settings.scrollback) && cache_render(&cache, from, settings.quiet ? NULL : &mention) == -1) {
+			print_error("Failed to write message to stdout");
+			cache_close(&cache);
+			return -1;
+		}
+		if (settings.since_set) { // a query, nothing to connect for
+			cache_close(&cache);
+			return 0;
+		}
+	}
+
+	if (settings.replay_path != NULL) { // a capture instead of a server
+		int status = run_replay();
+		index_close(&search_index);
+		cache_close(&cache);
+		return status;
+	}
+
+	if (settings.stats_interval > 0) { // SIGALRM every interval asks for a machine readable stats line
+		struct itimerval timer = {
+			.it_interval = { .tv_sec = settings.stats_interval },
+			.it_value = { .tv_sec = settings.stats_interval },
+		};
+		setitimer(ITIMER_REAL, &timer, NULL);
+	}
+
+	// connect every session, they log in once something reads their sockets
+	engine_t engine = {0};
+	settings.running = true; // sets running to true before connecting to the server
+	if (engine_start(&engine, &settings) == -1) {
+		engine_destroy(&engine);
+		cache_close(&cache);
+		return -1;
+	}
+	if (settings.scrollback && cache.fd != -1) { // what the scrollback showed isn't printed again from the history
+		cache_prime(&cache, engine.sessions[0]);
+	}
+
+	if (settings.event_loop || settings.bench || engine.session_count > 1) { // everything runs on this thread from here on
+		int status = run_event_loop(&engine);
+		if (settings.bench) {
+			bench_report(&engine);
+		}
+		if (settings.stats) {
+			stats_print(&engine, false);
+		}
+		engine_destroy(&engine);
+		index_close(&search_index);
+		cache_close(&cache);
+		return status;
+	}
+	session_t* session = engine.sessions[0];
+
+	// create and start the receive and render threads, connected by the frame queue
+	void* status; // stores the status of the exited receive thread
+	void* render_status; // stores the status of the exited render thread
+	pthread_t receive_messages; // declare a new thread
+	pthread_t render_messages; // formats and prints what the receive thread queued
+	frame_pool_init(&frame_pool);
+	if (frame_queue_init(&frame_queue) == -1) {
+		engine_destroy(&engine);
+		return -1;
+	}
+	session->queue = &frame_queue;
+
+	// creates the worker threads, the stats signals stay blocked in them so they always interrupt the main thread
+	sigset_t stats_signals;
+	sigemptyset(&stats_signals);
+	sigaddset(&stats_signals, SIGUSR1);
+	sigaddset(&stats_signals, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+	int created = pthread_create(&render_messages, NULL, render_messages_thread, session);
+	if (created == 0) {
+		created = pthread_create(&receive_messages, NULL, receive_messages_thread, session);
+		if (created != 0) { // the render thread exits once the queue is closed
+			frame_queue_close(&frame_queue);
+			pthread_join(render_messages, NULL);
+		}
+	}
+	pthread_sigmask(SIG_UNBLOCK, &stats_signals, NULL);
+	if (created != 0) { // checks for failure
+		print_error("Failed to create recieve messages thread");
+		engine_destroy(&engine);
+		return -1;
+	}
+
+	// logs in only now so the receive thread is already waiting when the history arrives
+	bool login_failed = session_login(session) == -1;
+	if (login_failed) { // nothing more may be sent, wakes the receive thread so it can be joined
+		settings.running = false;
+		session->logged_out = true;
+		shutdown(session->socket_fd, SHUT_RDWR);
+	}
+	
+	if (settings.batch) { // reads stdin in blocks and sends paced, coalesced frames instead of one write per line
+		batch_read_input(&engine);
+	}
+	char input_buffer[1024];
+	while (settings.running && !settings.batch) {
+		// reads a line from stdin
+		if (fgets(input_buffer, sizeof(input_buffer), stdin) == NULL) { // checks for failure or EOF
+			if (errno == EINTR && ferror(stdin) && settings.running) { // a stats signal, not a shutdown
+				clearerr(stdin);
+				stats_poll(&engine);
+				continue;
+			}
+			break;
+		}
+		if (!settings.running) { // checks if disconnected
+			break;
+		}
+		
+		// get rid of newline character
+		size_t len = strnlen(input_buffer, sizeof(input_buffer));
+		if (len > 0 && input_buffer[len-1] == '\n') { // checks for new line character
+			input_buffer[len-1] = '\0'; // replaces new line with null terminator
+			len--; // updates the length 
+		}
+
+		if (send_input_line(session, input_buffer, len) == -1 || send_queue_wait(session, &engine) == -1) { // validates and sends the line, paced
+			if (settings.running) { // not interrupted by a shutdown while waiting for the rate limit
+				print_error("Failed to write to server");
+			}
+			break;
+		}
+	}	 
+  	settings.running = false; // EOF or error
+	
+	if (session_logout(session) == -1) { // sends a logout message unless the server disconnected us
+		engine_destroy(&engine);
+		return -1; 
 	}
 
 	// while some condition(s) are true
@@ -437,13 +4278,22 @@ int main(int argc, char *argv[]) {
 	// wait for the thread / clean up
 
 	pthread_join(receive_messages, &status); // waits for the thread to exit
+	pthread_join(render_messages, &render_status); // the render thread drains the queue first
+	if (render_status != NULL) {
+		status = render_status;
+	}
+	if (settings.stats) {
+		stats_print(&engine, false);
+	}
+	index_close(&search_index); // both threads are gone, nothing appends anymore
+	cache_close(&cache);
 	
-	if (status != NULL) { // checks for failure in worker thread
-		close(settings.socket_fd);
+	if (status != NULL || login_failed) { // checks for failure in worker thread
+		engine_destroy(&engine);
 		return -1;
 	}
 
 	// cleanup and return
-	close(settings.socket_fd); // closes the socket
+	engine_destroy(&engine); // closes the socket
 	return 0;
 }
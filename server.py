@@ -7,16 +7,32 @@ import datetime
 import enum
 import os
 import signal
+import selectors
+import argparse
+import errno
+import collections
+import json
+import sys
 
 LOG_FILE = "messages.log"
-LOG_ENTRIES = []
+HISTORY_DEPTH = 25  # messages a new client gets, --history overrides it
+LOG_BATCH_ENTRIES = 64  # queued log lines that trigger a write right away
+LOG_FLUSH_SECONDS = 0.05  # longest a log line waits in the queue
 log_lock = threading.Lock()
 
-clients = []   # list of (socket, username, ip)
 clients_lock = threading.Lock()
 running = True
 server_socket = None  # Global reference to server socket for signal handlers
 
+LOGIN_TIMEOUT_SECONDS = 5.0  # time a new connection has to send LOGIN
+IDLE_TIMEOUT_SECONDS = 15 * 60  # 15 minutes without a frame from a logged in client
+RESERVED_USERNAMES = ["SYSTEM", "SERVER", "ADMIN", "ROOT"]
+RATE_LIMIT = 5.0  # messages per second a client may send, --rate overrides it
+RATE_BURST = 5  # messages a client may send at once, --burst overrides it
+OVER_LIMIT = "throttle"  # what happens to a client over the limit, --over-limit overrides it
+HELP_MESSAGE = "Commands: !help, !list, !stats, !disconnect"
+OUTBOUND_HIGH_WATER = 1 << 20  # bytes queued for a client before it is dropped as too slow
+
 
 def is_ascii(s):
     """
@@ -69,15 +85,26 @@ class Message:
         MSG_LOGIN        = 0
         MSG_LOGOUT       = 1
         MSG_MESSAGE_SEND = 2
+        MSG_KEEPALIVE    = 3   # no-op that only resets the idle timeout, never logged or broadcast
         MSG_MESSAGE_RECV = 10
         MSG_DISCONNECT   = 12
         MSG_SYSTEM       = 13
+        MSG_LOGIN_ACK    = 14  # sent (fixed size) before history, lists the LOGIN capabilities the server accepted
 
     USERNAME_LEN = 32
     MESSAGE_LEN = 1024
     MSG_FMT = "!II32s1024s"   # type, timestamp, username, message
     MSG_SIZE = struct.calcsize(MSG_FMT)
 
+    # Compact framing: a length prefixed header followed by the username and message bytes (no padding).
+    # The high bit of the first byte is always clear in the fixed size format, so every frame says which one it is.
+    COMPACT_FLAG = 0x80
+    COMPACT_FMT = "!BBHI"     # flag | type, username length, message length, timestamp
+    COMPACT_HEADER_SIZE = struct.calcsize(COMPACT_FMT)
+    CAPABILITY_COMPACT = "compact"  # LOGIN message field asking for compact framing
+    CAPABILITY_KEEPALIVE = "keepalive"  # LOGIN message field asking whether MSG_KEEPALIVE is understood
+    CAPABILITIES = (CAPABILITY_COMPACT, CAPABILITY_KEEPALIVE)
+
     message_type: int
     username: str
     message: str
@@ -96,13 +123,36 @@ class Message:
         msg_bytes = msg_bytes + b"\x00" * (self.MESSAGE_LEN - len(msg_bytes))  # Null pad
         return struct.pack(self.MSG_FMT, self.message_type, self.timestamp, uname_bytes, msg_bytes)
 
+    def pack_compact(self):
+        uname_bytes = self.username.encode("utf-8")[:self.USERNAME_LEN-1]
+        msg_bytes = self.message.encode("utf-8")[:self.MESSAGE_LEN-1]
+        header = struct.pack(self.COMPACT_FMT, self.COMPACT_FLAG | self.message_type, len(uname_bytes), len(msg_bytes), self.timestamp)
+        return header + uname_bytes + msg_bytes
+
+    def pack(self, compact=False):
+        return self.pack_compact() if compact else self.pack_message()
+
     @staticmethod
     def unpack_message(data):
+        if data[0] & Message.COMPACT_FLAG:
+            return Message.unpack_compact(data)
         msg_type, ts, uname_bytes, msg_bytes = struct.unpack(Message.MSG_FMT, data)
         username = uname_bytes.split(b"\x00", 1)[0].decode("utf-8", errors="ignore")
         message = msg_bytes.split(b"\x00", 1)[0].decode("utf-8", errors="ignore")
         return Message(msg_type, username, message, ts)
 
+    @staticmethod
+    def unpack_compact(data):
+        flag_type, uname_len, msg_len, ts = struct.unpack_from(Message.COMPACT_FMT, data)
+        if uname_len >= Message.USERNAME_LEN or msg_len >= Message.MESSAGE_LEN:
+            raise ValueError("Compact frame field too long")
+        if len(data) != Message.COMPACT_HEADER_SIZE + uname_len + msg_len:
+            raise ValueError("Compact frame length mismatch")
+        body = data[Message.COMPACT_HEADER_SIZE:]
+        username = body[:uname_len].split(b"\x00", 1)[0].decode("utf-8", errors="ignore")
+        message = body[uname_len:].split(b"\x00", 1)[0].decode("utf-8", errors="ignore")
+        return Message(flag_type & ~Message.COMPACT_FLAG, username, message, ts)
+
 
 def send_all(sock, data):
     """
@@ -116,6 +166,81 @@ def send_all(sock, data):
         view = view[n:]
 
 
+class ClientWriter:
+    """
+    Bounded outbound queue of a logged in client, drained by its own writer thread
+    so a stalled receiver never blocks the thread that broadcasts to it
+    """
+
+    def __init__(self, sock, username, ip):
+        self.sock = sock
+        self.username = username
+        self.ip = ip
+        self.queue = collections.deque()
+        self.queued = 0         # bytes in queue
+        self.closing = False
+        self.dropped = False
+        self.cond = threading.Condition()
+        self.thread = threading.Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def send(self, data):
+        """
+        Queue a frame, drops the client once more than OUTBOUND_HIGH_WATER bytes are waiting
+        """
+        with self.cond:
+            if self.closing or self.dropped:
+                return
+            if self.queued + len(data) > OUTBOUND_HIGH_WATER:
+                print(f"[ERROR] {self.ip}: {self.username} is too slow, dropping it with {self.queued} bytes queued")
+                self.drop()
+                return
+            self.queue.append(data)
+            self.queued += len(data)
+            self.cond.notify()
+
+    def drop(self):
+        # called with cond held, shutting the socket down also fails the client thread's recv
+        self.dropped = True
+        self.queue.clear()
+        self.queued = 0
+        self.cond.notify()
+        try:
+            self.sock.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+
+    def run(self):
+        while True:
+            with self.cond:
+                while not self.queue and not self.closing and not self.dropped:
+                    self.cond.wait()
+                if self.dropped or not self.queue:
+                    return
+                data = self.queue.popleft()
+                self.queued -= len(data)
+            try:
+                send_all(self.sock, data)
+            except Exception as e:
+                print(f"[ERROR] ClientWriter send to {self.username}({self.ip}): {e}")
+                with self.cond:
+                    self.drop()
+                return
+
+    def close(self, timeout=1.0):
+        """
+        Let the writer flush what is queued, a client that doesn't read it within timeout is dropped
+        """
+        with self.cond:
+            self.closing = True
+            self.cond.notify()
+        self.thread.join(timeout)
+        if self.thread.is_alive():
+            with self.cond:
+                self.drop()
+            self.thread.join()
+
+
 def recv_all(sock, n):
     """
     Helper to ensure no short reads
@@ -129,47 +254,338 @@ def recv_all(sock, n):
     return bytes(buf)
 
 
+def recv_frame(sock):
+    """
+    Receive one frame in either framing, compact frames have the high bit of their first byte set
+    """
+    first = recv_all(sock, 1)
+    if not first[0] & Message.COMPACT_FLAG:
+        return first + recv_all(sock, Message.MSG_SIZE - 1)
+    header = first + recv_all(sock, Message.COMPACT_HEADER_SIZE - 1)
+    _, uname_len, msg_len, _ = struct.unpack(Message.COMPACT_FMT, header)
+    return header + recv_all(sock, uname_len + msg_len)
+
+
+def frame_length(buf):
+    """
+    Length of the frame at the start of buf in either framing, or 0 if not enough of it is buffered to tell
+    """
+    if not buf:
+        return 0
+    if not buf[0] & Message.COMPACT_FLAG:
+        return Message.MSG_SIZE
+    if len(buf) < Message.COMPACT_HEADER_SIZE:
+        return 0
+    _, uname_len, msg_len, _ = struct.unpack_from(Message.COMPACT_FMT, buf)
+    return Message.COMPACT_HEADER_SIZE + uname_len + msg_len
+
+
+def login_error(msg, username_taken):
+    """
+    Check a LOGIN frame, returns (username to report, reason) if the client must be disconnected or None
+    username_taken(name) tells whether the name is already connected
+    """
+    if msg.message_type != Message.MessageType.MSG_LOGIN.value:
+        return "???", "First message must be LOGIN"
+    if not msg.username or not msg.username.strip():
+        return "???", "Username must not be empty"
+    if not is_ascii(msg.username) or not msg.username.isalnum():
+        return "???", "Username must be alphanumeric and ASCII"
+    if username_taken(msg.username):
+        return msg.username, "Username already connected"
+    if msg.username in RESERVED_USERNAMES:
+        return msg.username, "Username is reserved"
+    return None
+
+
+def negotiate(msg):
+    """
+    The capabilities of a LOGIN the server accepts, returns (LOGIN_ACK frame or None, compact)
+    """
+    requested = msg.message.split()
+    accepted = [c for c in Message.CAPABILITIES if c in requested]
+    if not accepted:
+        return None, False
+    ack = Message(Message.MessageType.MSG_LOGIN_ACK.value, "SYSTEM", " ".join(accepted)).pack_message()
+    return ack, Message.CAPABILITY_COMPACT in accepted
+
+
+class HistoryRing:
+    """
+    The last capacity MSG_MESSAGE_SEND entries of the log, kept as packed MSG_MESSAGE_RECV frames in both framings
+    so a login costs one sendall of a buffer that is only rebuilt after a new message
+    """
+
+    def __init__(self, capacity):
+        self.frames = collections.deque(maxlen=capacity)  # (full, compact) per message, oldest first
+        self.joined = [None, None]  # cached contiguous history per framing, indexed by the compact flag
+
+    def add(self, entry):
+        # called with log_lock held, only message sends are history
+        if entry.message_type != Message.MessageType.MSG_MESSAGE_SEND.value:
+            return
+        message = Message(Message.MessageType.MSG_MESSAGE_RECV.value, entry.username, entry.message, entry.timestamp)
+        self.frames.append((message.pack(False), message.pack(True)))
+        self.joined = [None, None]
+
+    def buffer(self, compact):
+        """
+        The whole history as one buffer
+        """
+        with log_lock:
+            if self.joined[compact] is None:
+                self.joined[compact] = b"".join(frame[compact] for frame in self.frames)
+            return self.joined[compact]
+
+
+HISTORY = HistoryRing(HISTORY_DEPTH)
+
+
+class TokenBucket:
+    """
+    Rate limiting: a client holds up to RATE_BURST tokens, refilled at RATE_LIMIT per second, and every message takes one
+    """
+
+    def __init__(self):
+        self.tokens = float(RATE_BURST)
+        self.last = time.monotonic()
+
+    def take(self, now):
+        """
+        Take a token, returns 0.0 if there was one or else the seconds until there is
+        """
+        self.tokens = min(float(RATE_BURST), self.tokens + (now - self.last) * RATE_LIMIT)
+        self.last = now
+        if self.tokens >= 1.0:
+            self.tokens -= 1.0
+            return 0.0
+        return (1.0 - self.tokens) / RATE_LIMIT
+
+
+rate_counters = {"passed": 0, "throttled": 0, "disconnected": 0}
+rate_lock = threading.Lock()
+
+
+def rate_count(counter):
+    with rate_lock:
+        rate_counters[counter] += 1
+
+
+def rate_limit_reason():
+    # states the whole bucket so a client can pace itself to it: RATE_BURST at once, RATE_LIMIT per second after that
+    return f"Too many messages (rate {RATE_LIMIT:g}/s, burst {RATE_BURST})"
+
+
+def stats_reply():
+    with rate_lock:
+        counters = dict(rate_counters)
+    return (f"Rate limiter: {counters['passed']} messages passed, {counters['throttled']} throttled, "
+            f"{counters['disconnected']} disconnected ({RATE_LIMIT:g}/s, burst {RATE_BURST}, {OVER_LIMIT})")
+
+
+def message_error(msg):
+    """
+    Check the text of a MESSAGE_SEND frame, returns the disconnect reason or None
+    """
+    if not msg.message:
+        return "Messages must not be empty"
+    if "\n" in msg.message:
+        return "Messages must not contain newlines"
+    if not is_ascii(msg.message) or not msg.message.isprintable():
+        return "Messages must be ASCII"
+    return None
+
+
+def list_reply(usernames):
+    return f"There are {len(usernames)} user(s) connected: {', '.join(usernames)}"
+
+
+class ClientRegistry:
+    """
+    The logged in clients by username and by socket, in login order, with the !list reply cached
+    until the membership changes. Not locked, threaded mode holds clients_lock around it
+    """
+
+    def __init__(self):
+        self.by_username = {}   # username -> client
+        self.by_socket = {}     # socket -> username
+        self.list_cache = None
+
+    def __len__(self):
+        return len(self.by_username)
+
+    def taken(self, username):
+        return username in self.by_username
+
+    def values(self):
+        return [client for client in self.by_username.values() if client is not None]
+
+    def add(self, username, sock, client):
+        """
+        Returns False if the username got taken since the LOGIN was checked.
+        With --workers the names of the other workers' clients are added with sock and client None
+        """
+        if username in self.by_username:
+            return False
+        self.by_username[username] = client
+        if sock is not None:
+            self.by_socket[sock] = username
+        self.list_cache = None
+        return True
+
+    def remove_name(self, username):
+        # only for the names added without a socket
+        if self.by_username.get(username, 1) is None:
+            del self.by_username[username]
+            self.list_cache = None
+
+    def remove(self, sock):
+        """
+        Returns the client that was registered for sock or None
+        """
+        username = self.by_socket.pop(sock, None)
+        if username is None:
+            return None
+        self.list_cache = None
+        return self.by_username.pop(username)
+
+    def clear(self):
+        self.by_username.clear()
+        self.by_socket.clear()
+        self.list_cache = None
+
+    def list_message(self):
+        if self.list_cache is None:
+            self.list_cache = list_reply(list(self.by_username))
+        return self.list_cache
+
+
+clients = ClientRegistry()  # (ClientWriter, username, ip, compact) of the logged in clients in threaded mode
+
+
+class LogWriter:
+    """
+    Background writer of the log file: lines are queued and group committed once LOG_BATCH_ENTRIES are waiting
+    or the oldest waited LOG_FLUSH_SECONDS, so no client thread waits on disk I/O.
+    fsync policy: "never" only flushes, "batch" fsyncs every commit, "interval" at most once a second
+    """
+    FSYNC_POLICIES = ["never", "batch", "interval"]
+
+    def __init__(self):
+        self.queue = []      # serialized lines, queued before start() are written once it runs
+        self.oldest = 0.0    # monotonic time the first line in queue was queued
+        self.stopping = False
+        self.cond = threading.Condition()
+        self.thread = None
+
+    def start(self, path, fsync):
+        self.file = open(path, "a", encoding="utf-8")
+        self.fsync = fsync
+        self.last_fsync = time.monotonic()
+        self.thread = threading.Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def write(self, entry):
+        with self.cond:
+            if not self.queue:
+                self.oldest = time.monotonic()
+            self.queue.append(entry.serialize() + "\n")
+            if len(self.queue) == 1 or len(self.queue) >= LOG_BATCH_ENTRIES:
+                self.cond.notify()
+
+    def run(self):
+        while True:
+            with self.cond:
+                while not self.stopping and len(self.queue) < LOG_BATCH_ENTRIES:
+                    if not self.queue:
+                        self.cond.wait()
+                        continue
+                    remaining = self.oldest + LOG_FLUSH_SECONDS - time.monotonic()
+                    if remaining <= 0:
+                        break
+                    self.cond.wait(remaining)
+                lines, self.queue = self.queue, []
+                stopping = self.stopping
+            if lines:
+                self.commit(lines)
+            if stopping:
+                self.file.close()
+                return
+
+    def commit(self, lines):
+        try:
+            self.file.write("".join(lines))
+            self.file.flush()
+            now = time.monotonic()
+            if self.fsync == "batch" or (self.fsync == "interval" and now - self.last_fsync >= 1.0):
+                os.fsync(self.file.fileno())
+                self.last_fsync = now
+        except Exception as e:
+            print(f"[ERROR] LogWriter failed to write {len(lines)} entries: {e}")
+
+    def close(self):
+        """
+        Write out everything still queued and close the file
+        """
+        if not self.thread:
+            return
+        with self.cond:
+            self.stopping = True
+            self.cond.notify()
+        self.thread.join()
+        self.thread = None
+
+
+LOG_WRITER = LogWriter()
+
+
 def append_log(entry: LogEntry):
     """
-    Append a log entry to the log entries list and write to the log file
+    Append a log entry to the history ring and queue it for the log file
     """
     with log_lock:
-        LOG_ENTRIES.append(entry)
-    with open(LOG_FILE, "a", encoding="utf-8") as f:
-        f.write(entry.serialize() + "\n")
-        f.flush()
+        HISTORY.add(entry)
+    LOG_WRITER.write(entry)
 
 
-def send_disconnect(sock, username, reason, ip):
+def send_disconnect(sock, username, reason, ip, writer=None):
     """
-    Send to the client a disconnect message with the reason
+    Send to the client a disconnect message with the reason, through its writer once it is logged in
     """
     print(f"[ERROR] {ip}: {username} {reason}")
     append_log(LogEntry(ip, Message.MessageType.MSG_DISCONNECT.value, username, reason))
     message = Message(Message.MessageType.MSG_DISCONNECT.value, username, reason)
     try:
-        send_all(sock, message.pack_message())
+        if writer:
+            writer.send(message.pack_message())
+        else:
+            send_all(sock, message.pack_message())
     except Exception as e:
         print(f"[ERROR] send_disconnect(sock, {username}, {reason}, {ip}): {e}")
 
 
 def broadcast_message(message_type: int, username: str, message: str):
     """
-    Broadcast a message to all clients that are connected
+    Broadcast a message to all clients that are connected, only queues it so nobody waits on a slow receiver
     """
     try:
         message = Message(message_type, username, message)
         print(f"[MESSAGE] {message_type}\t{datetime.datetime.fromtimestamp(message.timestamp)}\t{username}: {message.message}")
+        frames = broadcast_frames(message)
         with clients_lock:
-            for sock, u, ip in clients:
-                try:
-                    send_all(sock, message.pack_message())
-                except Exception as e:
-                    print(f"[ERROR] broadcast_message send_all({message_type}, {username}, {message}, {ip}): {e}")
+            for writer, u, ip, compact in clients.values():
+                writer.send(frames[compact])
     except Exception as e:
         print(f"[ERROR] broadcast_message({message_type}, {username}, {message}): {e}")
 
 
+def broadcast_frames(message):
+    """
+    Pack a broadcast once per framing, indexed by the compact flag of the recipient
+    """
+    return (message.pack(False), message.pack(True))
+
+
 def client_thread(sock, addr):
     """
     Handle a client connection and all its recieved messages
@@ -177,7 +593,8 @@ def client_thread(sock, addr):
     """
     ip = addr[0]
     username = ""
-    message_times = []  # Track message times for rate limiting
+    writer = None       # every frame goes through the writer once the client is on the broadcast list
+    bucket = TokenBucket()
     
     try:
         # 1) LOGIN
@@ -185,8 +602,8 @@ def client_thread(sock, addr):
         print(f"[INFO] Waiting for LOGIN from {ip}")
         try:
             # Set 5 second timeout for login message
-            sock.settimeout(5.0)
-            data = recv_all(sock, Message.MSG_SIZE)
+            sock.settimeout(LOGIN_TIMEOUT_SECONDS)
+            data = recv_frame(sock)
             # Reset timeout to None (blocking) after successful login receive
             sock.settimeout(None)
         except Exception as e:
@@ -201,65 +618,41 @@ def client_thread(sock, addr):
             print(f"[ERROR] client_thread parse {e}")
             send_disconnect(sock, "???", "Failed to parse LOGIN message", ip)
             return
-        
-        # Is the message type LOGIN?
-        if msg.message_type != Message.MessageType.MSG_LOGIN.value:
-            send_disconnect(sock, "???", "First message must be LOGIN", ip)
-            return
-        
-        # Validate username
-        if not msg.username or not msg.username.strip():
-            send_disconnect(sock, "???", "Username must not be empty", ip)
-            return
-        
-        # Is the username ASCII and alphanumeric?
-        if not is_ascii(msg.username) or not msg.username.isalnum():
-            send_disconnect(sock, "???", "Username must be alphanumeric and ASCII", ip)
-            return
 
-        # Check if username is already connected
-        with clients_lock:
-            for _, u, _ in clients:
-                if u == msg.username:
-                    send_disconnect(sock, msg.username, "Username already connected", ip)
-                    return
-    
-        # check if the username is in the do not assign list
-        dn_list = ["SYSTEM", "SERVER", "ADMIN", "ROOT"]
-        if msg.username in dn_list:
-            send_disconnect(sock, msg.username, "Username is reserved", ip)
+        # Is it a LOGIN with a valid username that isn't connected or reserved?
+        def username_taken(name):
+            with clients_lock:
+                return clients.taken(name)
+        error = login_error(msg, username_taken)
+        if error:
+            send_disconnect(sock, error[0], error[1], ip)
             return
         username = msg.username
 
+        # Acknowledge the capabilities, with compact framing everything after this frame is sent compact
+        ack, compact = negotiate(msg)
+        if ack:
+            send_all(sock, ack)
+
         # 2) HISTORY
         print(f"[INFO] LOGIN succeeded for {username}({ip}). Sending history...")
         try:
-            # Get the last 25 messages with MSG_MESSAGE_SEND type
-            with log_lock:
-                # Look for MESSAGE_SEND entries in the last 100 messages, chances are there are 25 message sends there
-                history_messages = [
-                    entry for entry in LOG_ENTRIES[-100:]
-                    if entry.message_type == Message.MessageType.MSG_MESSAGE_SEND.value
-                ][-25:]
-            
             # Send each history entry as MSG_MESSAGE_RECV
-            for entry in history_messages:
-                print(entry.message)
-                history_msg = Message(
-                    Message.MessageType.MSG_MESSAGE_RECV.value,
-                    entry.username,
-                    entry.message,
-                    entry.timestamp
-                )
-                send_all(sock, history_msg.pack_message())
+            send_all(sock, HISTORY.buffer(compact))
         except Exception as e:
             print(f"[ERROR] client_thread history {e}")
 
         print(f"[INFO] History sent for {username}({ip}). Adding client to the broadcast list")
         # 3) join the clients list and broadcast the login
+        writer = ClientWriter(sock, username, ip)
         with clients_lock:
-            clients.append((sock, username, ip))
+            joined = clients.add(username, sock, (writer, username, ip, compact))
             num_connected = len(clients)
+        if not joined:
+            # another LOGIN with the same name finished its history first
+            send_disconnect(sock, username, "Username already connected", ip, writer)
+            username = ""
+            return
         append_log(LogEntry(ip, Message.MessageType.MSG_LOGIN.value, username, f"{username} logged in"))
         broadcast_message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{username} logged in")
         
@@ -267,12 +660,12 @@ def client_thread(sock, addr):
         welcome_msg = Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", 
                              f"Welcome! There are {num_connected} user(s) connected. Type !help for commands.")
         try:
-            send_all(sock, welcome_msg.pack_message())
+            writer.send(welcome_msg.pack(compact))
         except Exception as e:
             print(f"[ERROR] Failed to send welcome message to {username}({ip}): {e}")
 
-        # Set 30 minute timeout for message receiving
-        TIMEOUT_SECONDS = 15 * 60  # 15 minutes
+        # Set 15 minute timeout for message receiving
+        TIMEOUT_SECONDS = IDLE_TIMEOUT_SECONDS
         sock.settimeout(TIMEOUT_SECONDS)
 
         # 4) Main loop
@@ -280,14 +673,14 @@ def client_thread(sock, addr):
             print(f"[INFO] Waiting for LOGOUT/MSGRECV from client")
             # Can we receive a message?
             try:
-                data = recv_all(sock, Message.MSG_SIZE)
+                data = recv_frame(sock)
             except socket.timeout:
                 print(f"[ERROR] client_thread timeout: Client {username}({ip}) did not send a message within {TIMEOUT_SECONDS} seconds")
-                send_disconnect(sock, username, f"Disconnected due to timeout (no message received in {TIMEOUT_SECONDS // 60} minutes)", ip)
+                send_disconnect(sock, username, f"Disconnected due to timeout (no message received in {TIMEOUT_SECONDS // 60} minutes)", ip, writer)
                 break
             except Exception as e:
                 print(f"[ERROR] client_thread receive message {e}")
-                send_disconnect(sock, username, "Failed to receive message", ip)
+                send_disconnect(sock, username, "Failed to receive message", ip, writer)
                 break
             
             # Can we parse the message?
@@ -295,9 +688,13 @@ def client_thread(sock, addr):
                 msg = Message.unpack_message(data)
             except Exception as e:
                 print(f"[ERROR] client_thread parse message {e}")
-                send_disconnect(sock, username, "Failed to parse message", ip)
+                send_disconnect(sock, username, "Failed to parse message", ip, writer)
                 break
             
+            # Is this a KEEPALIVE? Receiving it already reset the idle timeout, nothing else to do
+            if msg.message_type == Message.MessageType.MSG_KEEPALIVE.value:
+                continue
+
             # Is this a LOGOUT message?
             if msg.message_type == Message.MessageType.MSG_LOGOUT.value:
                 print(f"[INFO] Client sent logout.")
@@ -307,26 +704,24 @@ def client_thread(sock, addr):
             # Is this a MESSAGE_SEND message?
             elif msg.message_type == Message.MessageType.MSG_MESSAGE_SEND.value:
                 print(f"[INFO] Client sent a message")
-                # Rate limiting: check if >5 messages in last second
-                current_time = time.time()
-                message_times = [t for t in message_times if current_time - t < 1.0]
-                if len(message_times) >= 5:
+                # Rate limiting: over the limit the client either waits for a token or is disconnected
+                delay = bucket.take(time.monotonic())
+                if delay and OVER_LIMIT == "disconnect":
                     print(f"[INFO] Client is spamming. Disconnecting client.")
-                    send_disconnect(sock, username, "Too many messages at once (>5 in a second)", ip)
+                    rate_count("disconnected")
+                    send_disconnect(sock, username, rate_limit_reason(), ip, writer)
                     break
-                message_times.append(current_time)
+                if delay:
+                    # nothing is read from the socket meanwhile, so TCP pushes back on the client
+                    rate_count("throttled")
+                    time.sleep(delay)
+                    bucket.take(time.monotonic())
+                rate_count("passed")
                 
                 # Check message validity
-                if not msg.message:
-                    send_disconnect(sock, username, "Messages must not be empty", ip)
-                    break
-                
-                if "\n" in msg.message:
-                    send_disconnect(sock, username, "Messages must not contain newlines", ip)
-                    break
-                
-                if not is_ascii(msg.message) or not msg.message.isprintable():
-                    send_disconnect(sock, username, "Messages must be ASCII", ip)
+                error = message_error(msg)
+                if error:
+                    send_disconnect(sock, username, error, ip, writer)
                     break
                 
                 # Log the message
@@ -334,18 +729,18 @@ def client_thread(sock, addr):
 
                 # Check if the message is a command
                 if msg.message == "!help":
-                    send_all(sock, Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", "Commands: !help, !list, !disconnect").pack_message())
+                    writer.send(Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", HELP_MESSAGE).pack(compact))
+                    continue
+                elif msg.message == "!stats":
+                    writer.send(Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", stats_reply()).pack(compact))
                     continue
                 elif msg.message == "!list":
                     with clients_lock:
-                        user_list = [u for _, u, _ in clients]
-                        user_list_str = ", ".join(user_list)
-                        num_connected = len(clients)
-                        message = f"There are {num_connected} user(s) connected: {user_list_str}"
-                    send_all(sock, Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", message).pack_message())
+                        message = clients.list_message()
+                    writer.send(Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", message).pack(compact))
                     continue
                 elif msg.message == "!disconnect":
-                    send_disconnect(sock, username, "User asked to be disconnected", ip)
+                    send_disconnect(sock, username, "User asked to be disconnected", ip, writer)
                     break
                 
                 # If it wasn't a command, broadcast the message to everyone
@@ -353,20 +748,19 @@ def client_thread(sock, addr):
                 broadcast_message(Message.MessageType.MSG_MESSAGE_RECV.value, username, msg.message)
 
             else:
-                send_disconnect(sock, username, "Message type not supported", ip)
+                send_disconnect(sock, username, "Message type not supported", ip, writer)
                 break
 
     except ConnectionError:
         print(f"[INFO] Client {ip} disconnected")
     except Exception as e:
         print(f"[ERROR] client_thread({ip}): {e}")
-        send_disconnect(sock, username, f"You caused a server error", ip)
+        send_disconnect(sock, username, f"You caused a server error", ip, writer)
     finally:
         with clients_lock:
-            for i, (s, u, ip2) in enumerate(clients):
-                if s is sock:
-                    clients.pop(i)
-                    break
+            clients.remove(sock)
+        if writer:
+            writer.close()
         try:
             sock.close()
         except Exception as e:
@@ -375,6 +769,630 @@ def client_thread(sock, addr):
             broadcast_message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{username} has disconnected")
 
 
+class Connection:
+    """
+    State of one client in event loop mode, what client_thread keeps in local variables
+    """
+    RECV_SIZE = 65536
+
+    def __init__(self, sock, addr):
+        self.sock = sock
+        self.ip = addr[0]
+        self.username = ""
+        self.compact = False
+        self.logged_in = False
+        self.closing = False        # a DISCONNECT is queued, the socket closes once it is written
+        self.inbuf = bytearray()
+        self.outbuf = bytearray()
+        self.bucket = TokenBucket()
+        self.waited = False         # the frame at the front of inbuf was already counted as throttled
+        self.events = 0             # what the selector watches, 0 when unregistered
+        self.login = None           # the LOGIN frame, kept until the username is granted
+        self.claim = None           # id of the hub claim for the username with --workers
+        self.deadline = time.monotonic() + LOGIN_TIMEOUT_SECONDS
+
+    def frames(self):
+        """
+        Yield every complete frame received so far
+        """
+        while True:
+            n = frame_length(self.inbuf)
+            if n == 0 or len(self.inbuf) < n:
+                return
+            frame = bytes(self.inbuf[:n])
+            del self.inbuf[:n]
+            yield frame
+
+
+class EventLoopServer:
+    """
+    Single threaded server: every socket is non-blocking and driven by a selector instead of a thread per client.
+    Sends the same frames in the same order as client_thread, so clients can't tell the modes apart.
+    """
+
+    def __init__(self, srv, bus=None):
+        self.srv = srv
+        self.selector = selectors.DefaultSelector()
+        self.connections = {}   # socket -> Connection
+        self.members = ClientRegistry()  # Connection of the logged in clients, plus the other workers' names
+        self.bus = bus          # BusEndpoint to the hub with --workers
+        self.claims = {}        # claim id -> Connection waiting for the hub to grant its username
+        self.throttled = {}     # Connection over the rate limit -> monotonic time it gets a token
+        self.next_claim = 0
+
+    def run(self):
+        self.srv.setblocking(False)
+        self.selector.register(self.srv, selectors.EVENT_READ)
+        if self.bus:
+            self.selector.register(self.bus.sock, selectors.EVENT_READ)
+        next_sweep = time.monotonic() + 1.0
+        while running:
+            timeout = 1.0
+            if self.throttled:
+                timeout = max(0.0, min(timeout, min(self.throttled.values()) - time.monotonic()))
+            for key, events in self.selector.select(timeout=timeout):
+                if key.fileobj is self.srv:
+                    self.accept()
+                    continue
+                if self.bus and key.fileobj is self.bus.sock:
+                    self.bus_events(events)
+                    continue
+                conn = key.data
+                if events & selectors.EVENT_WRITE:
+                    self.flush(conn)
+                if events & selectors.EVENT_READ and conn.sock in self.connections:
+                    self.read(conn)
+            now = time.monotonic()
+            for conn, until in list(self.throttled.items()):
+                if now >= until:
+                    del self.throttled[conn]
+                    self.watch(conn)
+                    self.process(conn)  # handles the frame that was put back first
+            if time.monotonic() >= next_sweep:
+                self.sweep()
+                next_sweep = time.monotonic() + 1.0
+            if self.bus:
+                self.bus.watch(self.selector)
+        self.shutdown()
+
+    def bus_events(self, events):
+        if events & selectors.EVENT_WRITE:
+            self.bus.flush()
+        if not events & selectors.EVENT_READ:
+            return
+        updates = self.bus.receive()
+        if updates is None:
+            global running
+            print("[ERROR] Lost the connection to the hub, shutting down")
+            running = False
+            return
+        for update in updates:
+            op = update["op"]
+            if op == "claimed":
+                conn = self.claims.pop(update["id"])
+                if conn.sock not in self.connections or conn.closing:
+                    # gone while the hub decided
+                    if update["ok"]:
+                        self.bus.send({"op": "release", "name": conn.username})
+                elif update["ok"]:
+                    self.join(conn)
+                    self.process(conn)
+                else:
+                    self.disconnect(conn, conn.username, "Username already connected")
+            elif op == "joined":
+                self.members.add(update["name"], None, None)
+            elif op == "left":
+                self.members.remove_name(update["name"])
+            elif op == "broadcast":
+                message = Message(update["type"], update["username"], update["message"], update["timestamp"])
+                if message.message_type == Message.MessageType.MSG_MESSAGE_RECV.value:
+                    with log_lock:
+                        HISTORY.add(LogEntry(update["ip"], Message.MessageType.MSG_MESSAGE_SEND.value,
+                                             message.username, message.message, message.timestamp))
+                self.deliver(message)
+
+    def accept(self):
+        while True:
+            try:
+                sock, addr = self.srv.accept()
+            except (BlockingIOError, InterruptedError):
+                return
+            except OSError as e:
+                print(f"[ERROR] accept {e}")
+                return
+            print(f"[INFO] Accepted connection from {addr[0]}:{addr[1]}")
+            print(f"[INFO] Waiting for LOGIN from {addr[0]}")
+            sock.setblocking(False)
+            conn = Connection(sock, addr)
+            self.connections[sock] = conn
+            self.watch(conn)
+
+    def read(self, conn):
+        try:
+            data = conn.sock.recv(Connection.RECV_SIZE)
+        except (BlockingIOError, InterruptedError):
+            return
+        except OSError as e:
+            print(f"[ERROR] client receive {e}")
+            data = b""
+        if not data:
+            if conn.logged_in:
+                print(f"[INFO] Client {conn.ip} disconnected")
+                self.close(conn)
+            else:
+                print(f"[ERROR] client_thread receive socket closed")
+                self.disconnect(conn, "???", "Failed to receive LOGIN message within 5s")
+            return
+        conn.inbuf.extend(data)
+        self.process(conn)
+
+    def process(self, conn):
+        if conn.closing or conn.claim is not None or conn in self.throttled:
+            return
+        for frame in conn.frames():
+            try:
+                if conn.logged_in:
+                    self.handle(conn, frame)
+                else:
+                    self.login(conn, frame)
+            except Exception as e:
+                print(f"[ERROR] client_thread({conn.ip}): {e}")
+                self.disconnect(conn, conn.username, f"You caused a server error")
+            if conn.closing or conn.claim is not None or conn in self.throttled:
+                break  # the rest waits for the hub's answer or a token, or is dropped with the connection
+
+    def login(self, conn, data):
+        # Can we parse the message?
+        try:
+            msg = Message.unpack_message(data)
+        except Exception as e:
+            print(f"[ERROR] client_thread parse {e}")
+            self.disconnect(conn, "???", "Failed to parse LOGIN message")
+            return
+
+        # Is it a LOGIN with a valid username that isn't connected or reserved?
+        error = login_error(msg, self.members.taken)
+        if error:
+            self.disconnect(conn, error[0], error[1])
+            return
+        conn.username = msg.username
+        if self.bus:
+            # the name is only checked against this worker's copy of the registry, the hub has the last word
+            conn.claim = self.next_claim
+            self.next_claim += 1
+            conn.login = msg
+            self.claims[conn.claim] = conn
+            self.bus.send({"op": "claim", "id": conn.claim, "name": conn.username})
+            return
+        conn.login = msg
+        self.join(conn)
+
+    def join(self, conn):
+        conn.claim = None
+        ack, conn.compact = negotiate(conn.login)
+        if ack:
+            self.send(conn, ack)
+
+        print(f"[INFO] LOGIN succeeded for {conn.username}({conn.ip}). Sending history...")
+        try:
+            self.send(conn, HISTORY.buffer(conn.compact))
+        except Exception as e:
+            print(f"[ERROR] client_thread history {e}")
+
+        print(f"[INFO] History sent for {conn.username}({conn.ip}). Adding client to the broadcast list")
+        conn.logged_in = True
+        conn.deadline = time.monotonic() + IDLE_TIMEOUT_SECONDS
+        self.members.add(conn.username, conn.sock, conn)
+        append_log(LogEntry(conn.ip, Message.MessageType.MSG_LOGIN.value, conn.username, f"{conn.username} logged in"))
+        self.broadcast(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{conn.username} logged in")
+        welcome_msg = Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM",
+                             f"Welcome! There are {len(self.members)} user(s) connected. Type !help for commands.")
+        self.send(conn, welcome_msg.pack(conn.compact))
+
+    def handle(self, conn, data):
+        conn.deadline = time.monotonic() + IDLE_TIMEOUT_SECONDS
+        # Can we parse the message?
+        try:
+            msg = Message.unpack_message(data)
+        except Exception as e:
+            print(f"[ERROR] client_thread parse message {e}")
+            self.disconnect(conn, conn.username, "Failed to parse message")
+            return
+
+        if msg.message_type == Message.MessageType.MSG_KEEPALIVE.value:
+            return
+        if msg.message_type == Message.MessageType.MSG_LOGOUT.value:
+            print(f"[INFO] Client sent logout.")
+            append_log(LogEntry(conn.ip, Message.MessageType.MSG_LOGOUT.value, conn.username, f"{conn.username} logged out"))
+            self.close(conn)
+            return
+        if msg.message_type != Message.MessageType.MSG_MESSAGE_SEND.value:
+            self.disconnect(conn, conn.username, "Message type not supported")
+            return
+
+        now = time.monotonic()
+        delay = conn.bucket.take(now)
+        if delay and OVER_LIMIT == "disconnect":
+            print(f"[INFO] Client is spamming. Disconnecting client.")
+            rate_count("disconnected")
+            self.disconnect(conn, conn.username, rate_limit_reason())
+            return
+        if delay:
+            # the frame goes back and the socket isn't read until a token is there, so TCP pushes back on the client
+            if not conn.waited:
+                rate_count("throttled")
+            conn.waited = True
+            conn.inbuf[:0] = data
+            self.throttled[conn] = now + delay
+            self.watch(conn)
+            return
+        conn.waited = False
+        rate_count("passed")
+        error = message_error(msg)
+        if error:
+            self.disconnect(conn, conn.username, error)
+            return
+        append_log(LogEntry(conn.ip, Message.MessageType.MSG_MESSAGE_SEND.value, conn.username, msg.message))
+
+        if msg.message == "!help":
+            self.send(conn, Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", HELP_MESSAGE).pack(conn.compact))
+        elif msg.message == "!stats":
+            self.send(conn, Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", stats_reply()).pack(conn.compact))
+        elif msg.message == "!list":
+            self.send(conn, Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", self.members.list_message()).pack(conn.compact))
+        elif msg.message == "!disconnect":
+            self.disconnect(conn, conn.username, "User asked to be disconnected")
+        else:
+            self.broadcast(Message.MessageType.MSG_MESSAGE_RECV.value, conn.username, msg.message, conn.ip)
+
+    def send(self, conn, data):
+        """
+        Queue data for the client and write as much of it as the socket takes right away
+        """
+        if conn.sock not in self.connections:
+            return
+        conn.outbuf.extend(data)
+        self.flush(conn)
+
+    def flush(self, conn):
+        while conn.outbuf:
+            try:
+                n = conn.sock.send(conn.outbuf)
+            except (BlockingIOError, InterruptedError):
+                break
+            except OSError as e:
+                print(f"[ERROR] send to {conn.username}({conn.ip}): {e}")
+                conn.outbuf.clear()
+                self.close(conn)
+                return
+            del conn.outbuf[:n]
+        if conn.sock not in self.connections:
+            return
+        if conn.closing and not conn.outbuf:
+            self.close(conn)
+            return
+        self.watch(conn)
+
+    def watch(self, conn):
+        """
+        Read unless the client is throttled, write while something is queued
+        """
+        events = (0 if conn in self.throttled else selectors.EVENT_READ) | (selectors.EVENT_WRITE if conn.outbuf else 0)
+        if events == conn.events:
+            return
+        if not events:
+            self.selector.unregister(conn.sock)
+        elif not conn.events:
+            self.selector.register(conn.sock, events, conn)
+        else:
+            self.selector.modify(conn.sock, events, conn)
+        conn.events = events
+
+    def broadcast(self, message_type, username, message, ip="0.0.0.0"):
+        message = Message(message_type, username, message)
+        print(f"[MESSAGE] {message_type}\t{datetime.datetime.fromtimestamp(message.timestamp)}\t{username}: {message.message}")
+        if self.bus:
+            self.bus.send({"op": "broadcast", "type": message_type, "username": username,
+                           "message": message.message, "timestamp": message.timestamp, "ip": ip})
+        self.deliver(message)
+
+    def deliver(self, message):
+        """
+        Send a broadcast to the clients of this process
+        """
+        frames = broadcast_frames(message)
+        for conn in self.members.values():
+            if len(conn.outbuf) + len(frames[conn.compact]) > OUTBOUND_HIGH_WATER:
+                print(f"[ERROR] {conn.ip}: {conn.username} is too slow, dropping it with {len(conn.outbuf)} bytes queued")
+                self.close(conn)
+                continue
+            self.send(conn, frames[conn.compact])
+
+    def disconnect(self, conn, username, reason, flush=True):
+        """
+        Same as send_disconnect, the socket is closed once the DISCONNECT is written
+        """
+        print(f"[ERROR] {conn.ip}: {username} {reason}")
+        append_log(LogEntry(conn.ip, Message.MessageType.MSG_DISCONNECT.value, username, reason))
+        conn.closing = True
+        conn.outbuf.extend(Message(Message.MessageType.MSG_DISCONNECT.value, username, reason).pack_message())
+        if flush:
+            self.flush(conn)
+
+    def close(self, conn):
+        if conn.sock not in self.connections:
+            return
+        del self.connections[conn.sock]
+        self.throttled.pop(conn, None)
+        if conn.events:
+            self.selector.unregister(conn.sock)
+            conn.events = 0
+        if conn.outbuf and not conn.closing:
+            # a LOGOUT or a dead socket, whatever is left can't be delivered anymore
+            conn.outbuf.clear()
+        try:
+            conn.sock.close()
+        except Exception as e:
+            print(f"[ERROR] client_thread finally {e}")
+        if conn.logged_in and self.members.remove(conn.sock) is conn:
+            if self.bus:
+                self.bus.send({"op": "release", "name": conn.username})
+            self.broadcast(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{conn.username} has disconnected")
+
+    def sweep(self):
+        """
+        Disconnect the clients that didn't send LOGIN in time or stayed idle too long
+        """
+        now = time.monotonic()
+        for conn in list(self.connections.values()):
+            if conn.closing or now < conn.deadline:
+                continue
+            if conn.logged_in:
+                print(f"[ERROR] client_thread timeout: Client {conn.username}({conn.ip}) did not send a message within {IDLE_TIMEOUT_SECONDS} seconds")
+                self.disconnect(conn, conn.username, f"Disconnected due to timeout (no message received in {IDLE_TIMEOUT_SECONDS // 60} minutes)")
+            else:
+                print(f"[ERROR] client_thread receive timed out")
+                self.disconnect(conn, "???", "Failed to receive LOGIN message within 5s")
+            conn.deadline = now + 1.0  # gives the DISCONNECT a second to go out before the socket is dropped
+        for conn in list(self.connections.values()):
+            if conn.closing and now >= conn.deadline + 1.0:
+                self.close(conn)
+
+    def shutdown(self):
+        print("[INFO] Closing server...")
+        self.selector.unregister(self.srv)
+        self.srv.close()
+        print("[INFO] Sending disconnect messages and closing connections...")
+        for conn in list(self.connections.values()):
+            if conn.logged_in:
+                self.disconnect(conn, conn.username, "Server is shutting down", flush=False)
+            conn.sock.setblocking(True)
+            conn.sock.settimeout(1.0)
+            try:
+                send_all(conn.sock, conn.outbuf)
+            except Exception as e:
+                print(f"[ERROR] Failed to send disconnect to {conn.username}({conn.ip}): {e}")
+            conn.outbuf.clear()
+            self.members.remove(conn.sock)  # nobody is left to hear "has disconnected"
+            conn.logged_in = False
+            self.close(conn)
+        if self.bus:
+            self.bus.close()  # the hub writes the log entries of the shutdown
+        self.selector.close()
+        LOG_WRITER.close()
+        print("[INFO] Bye!")
+
+
+class BusEndpoint:
+    """
+    One end of the socketpair between the hub and a worker, carrying newline separated JSON objects
+    """
+    RECV_SIZE = 65536
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.sock.setblocking(False)
+        self.inbuf = bytearray()
+        self.outbuf = bytearray()
+        self.events = selectors.EVENT_READ  # what the selector currently watches
+
+    def send(self, obj):
+        self.outbuf.extend(json.dumps(obj).encode("utf-8") + b"\n")
+        self.flush()
+
+    def flush(self):
+        while self.outbuf:
+            try:
+                n = self.sock.send(self.outbuf)
+            except (BlockingIOError, InterruptedError):
+                return
+            except OSError as e:
+                print(f"[ERROR] bus send {e}")
+                self.outbuf.clear()
+                return
+            del self.outbuf[:n]
+
+    def watch(self, selector):
+        """
+        Watch for writability only while something is waiting to go out
+        """
+        events = selectors.EVENT_READ | (selectors.EVENT_WRITE if self.outbuf else 0)
+        if events != self.events:
+            selector.modify(self.sock, events)
+            self.events = events
+
+    def receive(self):
+        """
+        The objects received so far, or None once the other end is gone
+        """
+        try:
+            data = self.sock.recv(BusEndpoint.RECV_SIZE)
+        except (BlockingIOError, InterruptedError):
+            return []
+        except OSError:
+            data = b""
+        if not data:
+            return None
+        self.inbuf.extend(data)
+        end = self.inbuf.rfind(b"\n") + 1
+        lines = bytes(self.inbuf[:end]).splitlines()
+        del self.inbuf[:end]
+        return [json.loads(line) for line in lines]
+
+    def close(self):
+        """
+        Write out what is queued and close
+        """
+        try:
+            self.sock.setblocking(True)
+            self.sock.settimeout(1.0)
+            send_all(self.sock, self.outbuf)
+        except Exception as e:
+            print(f"[ERROR] bus close {e}")
+        self.outbuf.clear()
+        self.sock.close()
+
+
+class BusLogWriter:
+    """
+    Stands in for LOG_WRITER in a worker, the entries go to the hub which owns messages.log
+    """
+
+    def __init__(self, bus):
+        self.bus = bus
+
+    def write(self, entry):
+        self.bus.send({"op": "log", "line": entry.serialize()})
+
+    def close(self):
+        pass
+
+
+class WorkerHub:
+    """
+    Runs in the parent process with --workers: relays broadcasts between the workers, owns the username
+    registry (a name is only granted to one worker at a time) and writes the log entries of all of them
+    """
+
+    def __init__(self, endpoints, pids):
+        self.pids = pids
+        self.selector = selectors.DefaultSelector()
+        self.endpoints = {}     # socket -> (worker index, BusEndpoint)
+        self.owners = {}        # username -> index of the worker that owns the client
+        for index, bus in enumerate(endpoints):
+            self.endpoints[bus.sock] = (index, bus)
+            self.selector.register(bus.sock, selectors.EVENT_READ)
+
+    def others(self, index):
+        return [bus for i, bus in self.endpoints.values() if i != index]
+
+    def run(self):
+        stopping = False
+        while self.endpoints:
+            if not running and not stopping:
+                # workers send their clients the DISCONNECTs and close their end of the bus
+                print("[INFO] Stopping workers...")
+                for pid in self.pids:
+                    try:
+                        os.kill(pid, signal.SIGTERM)
+                    except ProcessLookupError:
+                        pass
+                stopping = True
+            for key, events in self.selector.select(timeout=1.0):
+                index, bus = self.endpoints[key.fileobj]
+                if events & selectors.EVENT_WRITE:
+                    bus.flush()
+                if events & selectors.EVENT_READ:
+                    updates = bus.receive()
+                    if updates is None:
+                        self.lost(index, bus)
+                        continue
+                    for update in updates:
+                        self.handle(index, bus, update)
+            for index, bus in list(self.endpoints.values()):
+                bus.watch(self.selector)
+        for pid in self.pids:
+            os.waitpid(pid, 0)
+
+    def handle(self, index, bus, update):
+        op = update["op"]
+        if op == "claim":
+            name = update["name"]
+            ok = name not in self.owners
+            bus.send({"op": "claimed", "id": update["id"], "ok": ok})
+            if ok:
+                self.owners[name] = index
+                for other in self.others(index):
+                    other.send({"op": "joined", "name": name})
+        elif op == "release":
+            name = update["name"]
+            if self.owners.get(name) == index:
+                del self.owners[name]
+                for other in self.others(index):
+                    other.send({"op": "left", "name": name})
+        elif op == "broadcast":
+            for other in self.others(index):
+                other.send(update)
+        elif op == "log":
+            LOG_WRITER.write(LogEntry.deserialize(update["line"]))
+
+    def lost(self, index, bus):
+        """
+        A worker exited, its clients are gone with it
+        """
+        if running:
+            print(f"[ERROR] Worker {index} exited")
+        self.selector.unregister(bus.sock)
+        del self.endpoints[bus.sock]
+        bus.sock.close()
+        for name, owner in list(self.owners.items()):
+            if owner == index:
+                del self.owners[name]
+                for other in self.others(index):
+                    other.send({"op": "left", "name": name})
+
+
+def run_workers(port, count, fsync):
+    """
+    Fork count event loop workers that each accept on port through their own SO_REUSEPORT socket,
+    then run the hub that ties them together in this process
+    """
+    global LOG_WRITER
+    endpoints = []
+    pids = []
+    for index in range(count):
+        hub_end, worker_end = socket.socketpair()
+        sys.stdout.flush()
+        pid = os.fork()
+        if pid == 0:
+            for bus in endpoints:
+                bus.sock.close()  # the sibling workers' ends belong to the hub
+            hub_end.close()
+            bus = BusEndpoint(worker_end)
+            LOG_WRITER = BusLogWriter(bus)
+            status = 0
+            try:
+                srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+                srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+                srv.bind(("0.0.0.0", port))
+                srv.listen(300)
+                print(f"[INFO] Worker {index} (pid {os.getpid()}) listening on 0.0.0.0:{port}")
+                EventLoopServer(srv, bus).run()
+            except Exception as e:
+                print(f"[ERROR] Worker {index}: {e}")
+                status = 1
+            sys.stdout.flush()
+            os._exit(status)
+        worker_end.close()
+        endpoints.append(BusEndpoint(hub_end))
+        pids.append(pid)
+    LOG_WRITER.start(LOG_FILE, fsync)
+    WorkerHub(endpoints, pids).run()
+    LOG_WRITER.close()
+    print("[INFO] Bye!")
+
+
 def signal_handler(signum, frame):
     """
     Handle SIGINT and SIGTERM signals by closing the server socket.
@@ -384,7 +1402,7 @@ def signal_handler(signum, frame):
     signal_name = signal.Signals(signum).name
     print(f"[INFO] Received {signal_name}, shutting down...")
     running = False
-    if server_socket:
+    if server_socket:  # unset in event loop mode, the loop notices running within a second
         try:
             server_socket.close()
         except Exception as e:
@@ -392,8 +1410,7 @@ def signal_handler(signum, frame):
 
 
 def main():
-    import sys
-    global running, server_socket
+    global running, server_socket, HISTORY, RATE_LIMIT, RATE_BURST, OVER_LIMIT
 
     # Register signal handlers for graceful shutdown
     signal.signal(signal.SIGINT, signal_handler)
@@ -401,9 +1418,34 @@ def main():
 
     # give the students a random port that is based on their username to avoid possible conflicts
     # they can specify with argv[1] an alternative port number if they want to
+    parser = argparse.ArgumentParser(description="mycord server")
+    parser.add_argument("port", nargs="?", type=int, help="port to listen on (default: based on $USER)")
+    parser.add_argument("--event-loop", action="store_true",
+                        help="serve every client from one selector loop instead of a thread per client")
+    parser.add_argument("--history", type=int, default=HISTORY_DEPTH, metavar="N",
+                        help=f"messages of history sent to a new client (default: {HISTORY_DEPTH})")
+    parser.add_argument("--fsync", choices=LogWriter.FSYNC_POLICIES, default="never",
+                        help="when to fsync messages.log after a write (default: never)")
+    parser.add_argument("--rate", type=float, default=RATE_LIMIT, metavar="R",
+                        help=f"messages per second a client may send (default: {RATE_LIMIT:g})")
+    parser.add_argument("--burst", type=int, default=RATE_BURST, metavar="B",
+                        help=f"messages a client may send at once (default: {RATE_BURST})")
+    parser.add_argument("--over-limit", choices=["throttle", "disconnect"], default=OVER_LIMIT,
+                        help="slow down a client over the rate limit or disconnect it (default: throttle)")
+    parser.add_argument("--workers", type=int, default=0, metavar="N",
+                        help="fork N event loop workers sharing the port with SO_REUSEPORT")
+    args = parser.parse_args()
+    if args.history < 0:
+        parser.error("--history must not be negative")
+    if args.workers < 0:
+        parser.error("--workers must not be negative")
+    if args.rate <= 0 or args.burst < 1:
+        parser.error("--rate must be positive and --burst at least 1")
+    RATE_LIMIT, RATE_BURST, OVER_LIMIT = args.rate, args.burst, args.over_limit
+    HISTORY = HistoryRing(args.history)
     port = hash(os.environ["USER"]) % (65535 - 2000) + 2000
-    if len(sys.argv) >= 2:
-        port = int(sys.argv[1])
+    if args.port is not None:
+        port = args.port
 
     print("[INFO] Loading history")
     try:
@@ -426,11 +1468,13 @@ def main():
             # Try to load existing log file
             amount = 0
             with open(LOG_FILE, "r") as f:
-                for line in f.readlines():
+                for line in f:  # only the ring is kept, not the whole file
                     line = line.strip()
                     if line:
                         try:
-                            LOG_ENTRIES.append(LogEntry.deserialize(line))
+                            entry = LogEntry.deserialize(line)
+                            with log_lock:
+                                HISTORY.add(entry)
                             amount += 1
                         except Exception as e:
                             print(f"[WARNING] Failed to load log entry: {e}")
@@ -439,15 +1483,23 @@ def main():
             print(f"[ERROR] Failed to load history: {e}")
             return
     print(f"[INFO] Parsed {amount} messages from the history file")
+    if args.workers:
+        run_workers(port, args.workers, args.fsync)
+        return
+    LOG_WRITER.start(LOG_FILE, args.fsync)
 
     # start the server
     srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
     srv.bind(("0.0.0.0", port))
     srv.listen(300)
-    server_socket = srv  # Store in global for signal handlers
     print(f"[INFO] mycord server listening on 0.0.0.0:{port}")
 
+    if args.event_loop:
+        EventLoopServer(srv).run()
+        return
+    server_socket = srv  # Store in global for signal handlers
+
     try:
         while running:
             sock, addr = srv.accept()
@@ -467,20 +1519,21 @@ def main():
         srv.close()
         print("[INFO] Sending disconnect messages and closing connections...")
         with clients_lock:
-            for sock, u, ip in clients:
+            for writer, u, ip, _ in clients.values():
                 try:
-                    # Set 1 second timeout for disconnect send in case socket is dead
-                    sock.settimeout(1.0)
-                    send_disconnect(sock, u, "Server is shutting down", ip)
+                    # Give the writer 1 second to flush the disconnect in case socket is dead
+                    send_disconnect(writer.sock, u, "Server is shutting down", ip, writer)
+                    writer.close()
                 except Exception as e:
                     print(f"[ERROR] Failed to send disconnect to {u}({ip}): {e}")
                 finally:
                     # Always close the socket after attempting to send disconnect
                     try:
-                        sock.close()
+                        writer.sock.close()
                     except Exception as e:
                         print(f"[ERROR] Failed to close socket for {u}({ip}): {e}")
             clients.clear()
+        LOG_WRITER.close()
         print("[INFO] Bye!")
 
 
@@ -0,0 +1,44 @@
+#!/bin/sh
+# /search and /from on a brand new cache must report 0 matches instead of crashing
+# usage: tests/search_empty_cache.sh [CLIENT] (builds ./client from client.c when CLIENT is omitted)
+set -eu
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+server=
+cleanup() {
+	[ -n "$server" ] && kill "$server" 2>/dev/null
+	rm -rf "$work"
+}
+trap cleanup EXIT
+
+client=${1:-}
+if [ -z "$client" ]; then
+	client=$work/client
+	gcc -Wall -Wextra "$root/client.c" -o "$client" -pthread
+fi
+
+port=${PORT:-$((20000 + $$ % 20000))}
+cp "$root/server.py" "$work/"
+: > "$work/messages.log"
+(cd "$work" && USER=${USER:-tester} exec python3 server.py "$port" > server.log 2>&1) &
+server=$!
+sleep 1
+
+status=0
+{ sleep 0.5; echo "/search alpha"; echo "/from bob"; sleep 0.5; } |
+	"$client" --port "$port" --cache "$work/empty.cache" > "$work/out.txt" 2>&1 || status=$?
+
+if [ "$status" -ne 0 ]; then
+	echo "FAIL: client exited with status $status"
+	cat "$work/out.txt"
+	exit 1
+fi
+for query in 'alpha' 'bob'; do
+	if ! grep -q "0 match(es) for \"$query\"" "$work/out.txt"; then
+		echo "FAIL: no empty result for \"$query\""
+		cat "$work/out.txt"
+		exit 1
+	fi
+done
+echo "PASS"